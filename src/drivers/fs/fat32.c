@@ -6,6 +6,7 @@
 #include <paging.h>
 #include <types.h>
 #include <alloc.h>
+#include <arena.h>
 #include <ata.h> 
 #include <bootinfo.h>
 #include <vfs.h>
@@ -21,7 +22,7 @@
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 /// @brief  Initializes a FAT32 file system.
 ///
-/// @param  allocator   The allocator used for allocating the FAT32 struct.
+/// @param  allocator   The allocator used for allocating the FAT32 struct and the caches.
 /// @param  drive       The drive where the file system is located.
 /// @param  partition   The number of the partition where the file system is located.
 /// @param  vbr         A pointer to the VBR of the partition.
@@ -31,7 +32,7 @@
 
 fat32_t* fat32_init(allocator_t *allocator, ata_t drive, u8 partition, vbr_t *vbr) {
 
-    fat32_t *fat32fs = (fat32_t*)allocator->alloc(allocator, sizeof(fat32_t));
+    fat32_t *fat32fs = ALLOC_TYPE(allocator, fat32_t);
 
     fat32fs->fs = (fs_t) {
         drive,
@@ -51,16 +52,14 @@ fat32_t* fat32_init(allocator_t *allocator, ata_t drive, u8 partition, vbr_t *vb
     fat32fs->sectors_per_cluster = vbr->sectors_per_cluster;
 
     mem_set((u8*)fat32fs->fats_loaded, -1, MAX_FAT_CACHE * sizeof(u32));
-    fat32fs->fats = (u8*)P2V(
-            pmem_alloc(kernel_pt4, MAX_FAT_CACHE * fat32fs->sectors_per_cluster)
-            );
+    fat32fs->fats = (u8*)allocator->alloc(
+            allocator, MAX_FAT_CACHE * fat32fs->sectors_per_cluster * 512);
 
     mem_set((u8*)fat32fs->dirs_loaded, -1, MAX_DIR_CACHE * sizeof(u32));
-    fat32fs->dirs = (u8*)P2V(
-            pmem_alloc(kernel_pt4, MAX_DIR_CACHE * fat32fs->sectors_per_cluster)
-            );
+    fat32fs->dirs = (u8*)allocator->alloc(
+            allocator, MAX_DIR_CACHE * fat32fs->sectors_per_cluster * 512);
 
-    fat32fs->root_dir = (u8*)P2V(pmem_alloc(kernel_pt4, fat32fs->sectors_per_cluster));
+    fat32fs->root_dir = (u8*)allocator->alloc(allocator, fat32fs->sectors_per_cluster * 512);
 
     fat32_load_cluster(fat32fs, fat32fs->root_dir, fat32fs->root_start_cluster);
 
@@ -96,19 +95,46 @@ void fat32_load_cluster(fat32_t *fs, u8 *dest, u32 cluster) {
 /// @param  max_clusters    Limit for how many clusters to load.
 ///
 /// @returns    The amount of loaded clusters.
+///
+/// The chain is collected in the scratch arena first, so consecutive clusters can be read with
+/// a single command.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 u32 fat32_load_cluster_chain(fat32_t *fs, u8 *dest, u32 cluster, u32 max_clusters) {
 
+    arena_allocator_t *scratch = scratch_arena();
+    arena_mark_t mark = arena_mark(scratch);
+
+    u32 *chain = (u32*)scratch->allocator.alloc(scratch, max_clusters * sizeof(u32));
+    u32 count = 0;
     u32 cur_cluster = cluster;
 
-    for (u64 i = 0; i < max_clusters; i++) {
+    while (count < max_clusters) {
 
-        fat32_load_cluster(fs, dest + i * fs->sectors_per_cluster * 512, cur_cluster);;
+        chain[count++] = cur_cluster;
         cur_cluster = fat32_next_cluster(fs, cur_cluster);
-        if (cur_cluster >= FAT32_EOF) return i + 1;
+        if (cur_cluster >= FAT32_EOF) break;
+    }
+
+    // a single read is limited to 255 sectors
+    u32 max_run = 255 / fs->sectors_per_cluster;
+    u32 run;
+
+    for (u32 i = 0; i < count; i += run) {
+
+        for (run = 1; i + run < count && run < max_run; run++)
+            if (chain[i + run] != chain[i] + run) break;
+
+        ata_read28(
+                fs->fs.drive,
+                dest + i * fs->sectors_per_cluster * 512,
+                fs->data_start_lba + (chain[i] - 2) * fs->sectors_per_cluster,
+                run * fs->sectors_per_cluster
+                );
     }
-    return max_clusters;
+
+    arena_rewind(scratch, mark);
+    return count;
 }
 
 
@@ -258,7 +284,7 @@ u64 fat32_cmp_path(const char *path_input, const char *path_entry) {
 /// @brief  Loads a file into RAM.
 ///
 /// @param  fs          The FAT32 file system.
-/// @param  allocator   The allocator used for allocating the File struct.
+/// @param  allocator   The allocator used for allocating the File struct and the data.
 /// @param  filepath    The path of the file to load.
 ///
 /// @returns    A pointer to the newly allocated File struct.
@@ -321,11 +347,14 @@ repeat:
     u32 max_clusters = entry->filesize / (512 * fs->sectors_per_cluster);
     if (entry->filesize % (512 * fs->sectors_per_cluster)) max_clusters++;
     
-    u8 *dest = (u8*)P2V(pmem_alloc_clean(kernel_pt4, max_clusters * fs->sectors_per_cluster));
+    // whole pages, so the data can be mapped into a process
+    u8 *dest = (u8*)allocator->alloc(
+            allocator, 
+            page_round_up(max_clusters * fs->sectors_per_cluster * 512) * PAGE_SIZE);
 
     fat32_load_cluster_chain(fs, dest, start_cluster, max_clusters);
 
-    file_t *f = (file_t*)allocator->alloc(&allocator, sizeof(file_t));
+    file_t *f = (file_t*)alloc_zeroed(allocator, sizeof(file_t));
     f->access_date = entry->access_date;
     f->create_date = entry->create_date;
     f->create_100ms = entry->create_100ms;
@@ -7,8 +7,47 @@
 
 
 #include <types.h>
+#include <utils.h>
 
 
+/// @brief  Number of size classes of the allocation histogram (powers of two from 8 bytes).
+#define ALLOC_HISTOGRAM_SIZE    16
+/// @brief  Number of events kept by an allocation trace (when built with -DALLOC_TRACE).
+#define ALLOC_TRACE_SIZE        512
+
+
+/// @brief  An allocation or free recorded by an allocation trace.
+typedef struct AllocEvent {
+    u64 tsc;
+    /// return address of the alloc/free call
+    u64 caller;
+    u64 vaddr;
+    /// the requested size (0 for frees)
+    u64 size;
+} alloc_event_t;
+
+/// @brief  Statistics of an allocator (see alloc_stats_enable).
+typedef struct AllocStats {
+    const char *name;
+    /// the functions of the allocator, replaced by the counting ones
+    u64 (*alloc)();
+    void (*free)();
+    u64 (*alloc_aligned)();
+
+    u64 allocs;
+    u64 frees;
+    u64 failed;
+    /// only allocators with a size function can track the bytes in use
+    u64 bytes_live;
+    u64 bytes_peak;
+    /// allocations per size class (up to 8, 16, 32 ... bytes, the last one is open)
+    u64 histogram[ALLOC_HISTOGRAM_SIZE];
+
+    /// ring buffer of the last events (0 = no tracing)
+    alloc_event_t *trace;
+    u64 trace_next;
+} alloc_stats_t;
+
 /// @brief  Abstract base of an allocator.
 typedef struct Allocator {
     u64 base_addr;
@@ -17,4 +56,43 @@ typedef struct Allocator {
     u64 (*alloc)();
     void (*free)();
     void (*init)();
+    /// returns the usable size of an allocated block (0 = not supported)
+    u64 (*size)();
+    /// allocates a block aligned to a power of two (freed with free)
+    u64 (*alloc_aligned)();
+    /// statistics and tracing (0 = disabled)
+    alloc_stats_t *stats;
 } allocator_t;
+
+
+/// @brief  Allocates an object of a type with the alignment the type requires.
+#define ALLOC_TYPE(allocator, type) \
+    ((type*)(allocator)->alloc_aligned((allocator), sizeof(type), _Alignof(type)))
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates zero-initialized memory using any allocator.
+///
+/// @param  allocator   The allocator to use.
+/// @param  n_bytes     How many bytes to allocate (and zero).
+///
+/// @returns    The pointer to the allocated memory.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE u64 alloc_zeroed(allocator_t *allocator, u64 n_bytes) {
+
+    u64 vaddr = allocator->alloc(allocator, n_bytes);
+    mem_set((u8*)vaddr, 0, n_bytes);
+    return vaddr;
+}
+
+
+void alloc_stats_enable(allocator_t *allocator, alloc_stats_t *stats, const char *name);
+u64 alloc_stats_alloc(allocator_t *self, u64 n_bytes);
+u64 alloc_stats_alloc_aligned(allocator_t *self, u64 n_bytes, u64 align);
+void alloc_stats_count(allocator_t *self, u64 vaddr, u64 n_bytes, u64 caller);
+void alloc_stats_free(allocator_t *self, u64 vaddr);
+void alloc_stats_print(allocator_t *allocator);
+u64 alloc_stats_class(u64 n_bytes);
+void alloc_trace_record(alloc_stats_t *stats, u64 caller, u64 vaddr, u64 n_bytes);
+void alloc_trace_print(allocator_t *allocator);
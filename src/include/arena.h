@@ -0,0 +1,88 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Header file for the arena allocator.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+
+#include <types.h>
+#include <alloc.h>
+#include <cpu.h>
+
+
+/// @brief  Alignment of every arena allocation.
+#define ARENA_ALIGN         16
+/// @brief  Size of the per-CPU scratch chunks in pages.
+#define SCRATCH_CHUNK_PAGES 4
+
+
+/// @brief  Header at the beginning of every chunk of an arena.
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    /// size of the chunk in pages (header included)
+    u64 pages;
+} ALIGNED(ARENA_ALIGN) arena_chunk_t;
+
+/// @brief  A saved position of an arena (see arena_mark and arena_rewind).
+typedef struct ArenaMark {
+    arena_chunk_t *chunk;
+    u64 top;
+} arena_mark_t;
+
+/// @brief  Arena Allocator class (chained chunks, freed all at once).
+///
+/// base_addr and space_left describe the current chunk, blocks is the size of all chunks.
+typedef struct ArenaAllocator {
+    allocator_t allocator;
+    arena_chunk_t *first;
+    arena_chunk_t *cur;
+    /// offset of the next allocation inside the current chunk
+    u64 top;
+    /// the minimum size of a new chunk in pages
+    u64 chunk_pages;
+} arena_allocator_t;
+
+#define CREATE_ARENA_ALLOCATOR(chunk_pages) (arena_allocator_t) { \
+        (allocator_t) { \
+            0, \
+            0, \
+            0, \
+            arena_alloc, \
+            arena_free, \
+            arena_init, \
+            0, \
+            arena_alloc_aligned \
+        }, 0, 0, 0, chunk_pages \
+    }; \
+
+
+extern arena_allocator_t scratch_arenas[MAX_CPUS];
+
+
+u64 arena_alloc(arena_allocator_t *self, u64 n_bytes);
+u64 arena_alloc_aligned(arena_allocator_t *self, u64 n_bytes, u64 align);
+void arena_free(arena_allocator_t *self, u64 vaddr);
+void arena_init(arena_allocator_t *self);
+
+arena_mark_t arena_mark(arena_allocator_t *self);
+void arena_rewind(arena_allocator_t *self, arena_mark_t mark);
+void arena_reset(arena_allocator_t *self);
+u64 arena_trim(arena_allocator_t *self);
+void arena_select(arena_allocator_t *self, arena_chunk_t *chunk, u64 top);
+void arena_next_chunk(arena_allocator_t *self, u64 n_bytes);
+
+void scratch_init(void);
+u64 scratch_shrink(u64 pages);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns the scratch arena of the executing CPU.
+///
+/// Short-lived allocations are made between arena_mark and arena_rewind, so nested users
+/// (e.g. a syscall loading a file) share the arena.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE arena_allocator_t* scratch_arena(void) {
+    return &scratch_arenas[cpu_id()];
+}
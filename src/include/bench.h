@@ -0,0 +1,47 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Header file for the in-kernel benchmarks.
+///
+/// Only built into the boot sequence when compiled with -DKERNEL_BENCH.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+
+#include <types.h>
+#include <buddy.h>
+#include <paging.h>
+
+
+#define BENCH_PMEM_CYCLES   1000000
+#define BENCH_PMEM_LIVE     256
+
+#define BENCH_PMEM_FILL_ALLOCS  10000
+#define BENCH_PMEM_FILL_RUN     16
+#define BENCH_PMEM_FILL_CHUNK   32
+
+#define BENCH_HEAP_OPS      200000
+#define BENCH_HEAP_LIVE     128
+#define BENCH_HEAP_PAGES    256
+#define BENCH_BUDDY_ROUNDS  1000
+
+/// @brief  Size of the vmem benchmark mapping in pages (1 GiB).
+#define BENCH_VMEM_PAGES    0x40000
+
+
+void bench_run(void);
+void bench_pmem(void);
+void bench_pmem_fill(u64 percent);
+
+void bench_heap(void);
+u64 bench_heap_cycles(
+        buddy_allocator_t *heap, 
+        u64 (*alloc)(buddy_allocator_t*, u64), 
+        void (*free)(buddy_allocator_t*, u64));
+u64 bench_heap_scan_alloc(buddy_allocator_t *self, u64 n_bytes);
+void bench_heap_scan_free(buddy_allocator_t *self, u64 vaddr);
+void bench_buddy(void);
+
+void bench_vmem(void);
+void bench_vmem_region(pt_t pt4, u64 flags, const char *name);
+void bench_vmem_free_tables(pt_t pt4);
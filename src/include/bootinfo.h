@@ -11,6 +11,9 @@
 #include <vfs.h>
 
 
+#define MAX_REGIONS     64
+
+
 /// @brief  Structure describing a virtual-to-physical address mapping.
 typedef struct PACKED Mapping {
     u64     phys;
@@ -10,42 +10,134 @@
 #include <alloc.h>
 
 
+// around 3.2% of allocatable space will be wasted per page
+#define BUDDY_BITMAP_SIZE   128
+#define LAYERS              10
+#define SMALLEST            8
+#define GREATEST            PAGE_SIZE
+#define GREATEST_SHIFT      12
+#define TOTAL_BLOCKS        1023
+
+/// @brief  Freed blocks are filled with this byte when compiled with -DBUDDY_POISON.
+#define BUDDY_POISON_BYTE   0x6b
+
+
+/// @brief  Free list links stored in every free block (offsets from base_addr, 0 = none).
+typedef struct BuddyLink {
+    u32 next;
+    u32 prev;
+} buddy_link_t;
+
 /// @brief  Buddy Allocator class.
 typedef struct BuddyAllocator {
     allocator_t allocator;
+    /// the first free block of each layer (offset from base_addr, 0 = empty)
+    u32 free_lists[LAYERS];
+    /// bit n is set if the free list of layer n is not empty
+    u64 free_mask;
+    /// the size of the reserved virtual range in pages (0 = fixed size heap)
+    u64 max_blocks;
+    /// the largest size the heap ever had in pages
+    u64 high_water;
+    u64 grows;
+    u64 shrinks;
 } buddy_allocator_t;
 
+/// @brief  Heap of a fixed number of physically contiguous pages.
 #define CREATE_BUDDY_ALLOCATOR(blocks) (buddy_allocator_t) { \
         (allocator_t) { \
-            P2V(pmem_alloc_clean(kernel_pt4, blocks)), \
+            P2V(pmem_alloc(blocks, PMEM_ZONE_ANY)), \
             blocks, \
             blocks * PAGE_SIZE, \
             buddy_alloc, \
             buddy_free, \
-            buddy_init \
-        } \
+            buddy_init, \
+            buddy_size, \
+            buddy_alloc_aligned \
+        }, {0}, 0, 0, blocks, 0, 0 \
     }; \
 
+/// @brief  Heap starting empty inside a reserved virtual range, pages are mapped on demand.
+#define CREATE_GROWABLE_BUDDY_ALLOCATOR(vaddr, max_blocks) (buddy_allocator_t) { \
+        (allocator_t) { \
+            vaddr, \
+            0, \
+            0, \
+            buddy_alloc, \
+            buddy_free, \
+            buddy_init, \
+            buddy_size, \
+            buddy_alloc_aligned \
+        }, {0}, 0, max_blocks, 0, 0, 0 \
+    }; \
 
-// around 3.2% of allocatable space will be wasted per page
-#define BUDDY_BITMAP_SIZE   128
-#define LAYERS              10
-#define SMALLEST            8
-#define GREATEST            PAGE_SIZE
-#define TOTAL_BLOCKS        1023
+
+extern const u16 buddy_layer_sizes[LAYERS];
+extern const u16 buddy_layer_offsets[LAYERS];
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns the size of the blocks in a layer.
+///
+/// @param  layer   The layer.
+///
+/// @returns    The blocksize of the layer.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE u64 buddy_layer_block_size(u64 layer) {
+
+    return buddy_layer_sizes[layer];
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns a layer's bit offset from the start of the Buddy Allocator bitmap.
+///
+/// @param  layer   The layer.
+///
+/// @returns    The bit offset of the layer from the start of the bitmap.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE u64 buddy_bit_offset_layer(u64 layer) {
+
+    return buddy_layer_offsets[layer];
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns the size of a layer in the Buddy Allocator bitmap in bits.
+///
+/// @param  layer   The layer.
+///
+/// @returns    The amount of bits associated with that layer.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE u64 buddy_bits_in_layer(u64 layer) {
+
+    return buddy_layer_offsets[layer] + 1;
+}
 
 
 void buddy_visualize_bitmap(u8* bitmap);
 
-u64 buddy_layer_block_size(u64 layer);
 u64 buddy_layer_from_size(u64 n_bytes);
-u64 buddy_bits_in_layer(u64 layer);
-u64 buddy_bit_offset_layer(u64 layer);
 
 bool buddy_bitmap_get_bit(u8 *bitmap, u64 bit);
 void buddy_bitmap_mark_bits(u8 *bitmap, u64 off, u64 count, bool val);
 void buddy_bitmap_mark_bit(u8 *bitmap, u64 off, bool val);
 
+void buddy_list_push(buddy_allocator_t *self, u64 vaddr, u64 layer);
+void buddy_list_remove(buddy_allocator_t *self, u64 vaddr, u64 layer);
+
 u64 buddy_alloc(buddy_allocator_t *self, u64 n_bytes);
+u64 buddy_alloc_aligned(buddy_allocator_t *self, u64 n_bytes, u64 align);
+u64 buddy_zalloc(buddy_allocator_t *self, u64 n_bytes);
 void buddy_free(buddy_allocator_t *self, u64 vaddr);
+u64 buddy_block_layer(u64 vaddr);
 void buddy_init(buddy_allocator_t *self);
+u64 buddy_size(buddy_allocator_t *self, u64 vaddr);
+
+void buddy_init_page(buddy_allocator_t *self, u64 vaddr);
+void buddy_grow(buddy_allocator_t *self);
+u64 buddy_shrink(buddy_allocator_t *self);
+void buddy_print_stats(buddy_allocator_t *self);
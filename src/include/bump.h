@@ -18,15 +18,18 @@ typedef struct BumpAllocator {
 
 #define CREATE_BUMP_ALLOCATOR(blocks) (bump_allocator_t) { \
         (allocator_t) { \
-            P2V(pmem_alloc_clean(kernel_pt4, blocks)), \
+            P2V(pmem_alloc_clean(blocks, PMEM_ZONE_ANY)), \
             blocks, \
             blocks * PAGE_SIZE, \
             bump_alloc, \
             bump_free, \
-            0 \
+            0, \
+            0, \
+            bump_alloc_aligned \
         }, 0 \
     }; \
 
 
 u64 bump_alloc(bump_allocator_t *self, u64 n_bytes);
+u64 bump_alloc_aligned(bump_allocator_t *self, u64 n_bytes, u64 align);
 void bump_free(bump_allocator_t *self, u64 n_bytes);
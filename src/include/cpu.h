@@ -0,0 +1,24 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Contains definitions for per-CPU data.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+
+#include <types.h>
+
+
+#define MAX_CPUS            8
+#define CACHE_LINE_SIZE     64
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns the index of the executing CPU.
+///
+/// Used to select per-CPU data. Always 0 as long as only the bootstrap processor is running.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE u64 cpu_id(void) {
+    return 0;
+}
@@ -31,6 +31,10 @@
 
 #define ELF_ARCH_X86_64     0x3e
 
+#define ELF_SEG_EXEC        (1 << 0)
+#define ELF_SEG_WRITE       (1 << 1)
+#define ELF_SEG_READ        (1 << 2)
+
 
 /// @brief  Enum of program segment types.
 typedef enum SegType {
@@ -0,0 +1,144 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Header file for the general purpose kernel heap.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+
+#include <types.h>
+#include <paging.h>
+#include <alloc.h>
+#include <buddy.h>
+#include <cpu.h>
+#include <spinlock.h>
+
+
+/// @brief  Allocations above this size are served as runs of whole pages.
+#define KMALLOC_SMALL_MAX   (GREATEST / 2)
+/// @brief  How many frames of a page run are handed back to pmem at once.
+#define KMALLOC_FREE_BATCH  64
+
+/// @brief  Capacity of a per-CPU bin.
+#define KMALLOC_BIN_SIZE    32
+/// @brief  How many blocks a bin gets from or gives back to the shared heap at once.
+#define KMALLOC_BIN_BATCH   16
+
+
+/// @brief  Free blocks of one size (buddy layer) cached by a CPU.
+typedef struct KmallocBin {
+    u64 count;
+    u64 blocks[KMALLOC_BIN_SIZE];
+} kmalloc_bin_t;
+
+/// @brief  Per-CPU front end of a Kmalloc Allocator.
+typedef struct KmallocCpu {
+    /// indexed by layer (layer 0 is never used)
+    kmalloc_bin_t bins[LAYERS];
+
+    u64 hits;
+    u64 misses;
+    u64 refills;
+    u64 flushes;
+} ALIGNED(CACHE_LINE_SIZE) kmalloc_cpu_t;
+
+/// @brief  Kmalloc Allocator class (small allocations + virtually contiguous page runs).
+typedef struct KmallocAllocator {
+    allocator_t allocator;
+    /// protects the shared heap and the page runs (only taken on refill, flush and runs)
+    spinlock_t lock;
+    /// MAX_CPUS front ends (allocated by kmalloc_init)
+    kmalloc_cpu_t *cpus;
+    /// growable heap for allocations up to KMALLOC_SMALL_MAX (first half of the range)
+    buddy_allocator_t small;
+    /// start of the page runs (second half of the range)
+    u64 large_base;
+    /// size of the page run area in pages
+    u64 large_pages;
+    /// next fit position (page index)
+    u64 large_next;
+    /// bit set for every mapped page
+    u64 *large_used;
+    /// bit set for the first page of every run
+    u64 *large_heads;
+    /// pages currently mapped for runs
+    u64 large_mapped;
+    u64 large_high_water;
+    u64 large_runs;
+} kmalloc_allocator_t;
+
+/// @brief  Kernel heap inside the virtual range starting at vaddr (size in bytes).
+#define CREATE_KMALLOC_ALLOCATOR(vaddr, size) (kmalloc_allocator_t) { \
+        (allocator_t) { \
+            vaddr, \
+            (size) / PAGE_SIZE, \
+            0, \
+            kmalloc_alloc, \
+            kmalloc_free, \
+            kmalloc_init, \
+            kmalloc_size, \
+            kmalloc_alloc_aligned \
+        }, 0, 0 \
+    }; \
+
+
+extern kmalloc_allocator_t kernel_heap;
+extern alloc_stats_t kernel_heap_stats;
+
+u64 kmalloc_alloc(kmalloc_allocator_t *self, u64 n_bytes);
+u64 kmalloc_alloc_aligned(kmalloc_allocator_t *self, u64 n_bytes, u64 align);
+u64 kmalloc_zalloc(kmalloc_allocator_t *self, u64 n_bytes);
+void kmalloc_free(kmalloc_allocator_t *self, u64 vaddr);
+void kmalloc_init(kmalloc_allocator_t *self);
+u64 kmalloc_size(kmalloc_allocator_t *self, u64 vaddr);
+
+u64 kmalloc_alloc_pages(kmalloc_allocator_t *self, u64 pages);
+void kmalloc_free_pages(kmalloc_allocator_t *self, u64 vaddr);
+void kmalloc_release_pages(kmalloc_allocator_t *self, u64 page, u64 *frames, u64 count);
+u64 kmalloc_find_run(kmalloc_allocator_t *self, u64 pages);
+void kmalloc_refill(kmalloc_allocator_t *self, kmalloc_bin_t *bin, u64 layer);
+void kmalloc_flush(kmalloc_allocator_t *self, kmalloc_bin_t *bin, u64 count);
+u64 kmalloc_shrink(kmalloc_allocator_t *self);
+void kmalloc_print_stats(kmalloc_allocator_t *self);
+
+void kernel_heap_init(void);
+u64 kernel_heap_shrink(u64 pages);
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates memory from the kernel heap.
+///
+/// @param  n_bytes How many bytes to allocate.
+///
+/// @returns    The pointer to the allocated memory.
+///
+/// Inlined so allocation traces show the real caller.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE u64 kmalloc(u64 n_bytes) {
+    return kernel_heap.allocator.alloc(&kernel_heap, n_bytes);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates zero-initialized memory from the kernel heap.
+///
+/// @param  n_bytes How many bytes to allocate.
+///
+/// @returns    The pointer to the allocated memory.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE u64 kzalloc(u64 n_bytes) {
+    return kmalloc_zalloc(&kernel_heap, n_bytes);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Frees memory allocated with kmalloc.
+///
+/// @param  vaddr   The start address of the memory to free.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE void kfree(u64 vaddr) {
+    kernel_heap.allocator.free(&kernel_heap, vaddr);
+}
@@ -10,6 +10,10 @@
 
 
 #define PAGE_SIZE   0x1000
+/// @brief  Size of a huge page mapped by a 2nd level page table entry.
+#define PAGE_SIZE_2M    0x200000
+/// @brief  Size of a huge page mapped by a 3rd level page table entry.
+#define PAGE_SIZE_1G    0x40000000
 
 
 #define PAGE_PRESENT            (1 << 0)
@@ -22,6 +26,8 @@
 #define PAGE_HUGE               (1 << 7)
 #define PAGE_GLOBAL             (1 << 8)
 #define PAGE_ALLOCATED          (1 << 9)
+/// @brief  Software bit: read-only page shared copy-on-write (writable after the copy).
+#define PAGE_COW                (1 << 10)
 
 #define GET_FLAG(pte, flag)     ((pte) & (flag))
 #define SET_FLAG(pte_ptr, flag) (*(pte_ptr) |= (flag))
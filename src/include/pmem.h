@@ -12,21 +12,106 @@
 #include <paging.h>
 
 
+/// @brief  Zone flags of pmem_alloc*: any zone, highest zone first.
+#define PMEM_ZONE_ANY       0
+/// @brief  Zone flags of pmem_alloc*: only ZONE_DMA (ISA DMA, below 16 MiB).
+#define PMEM_ZONE_DMA       (1 << 0)
+/// @brief  Zone flags of pmem_alloc*: only ZONE_DMA and ZONE_NORMAL (32-bit devices, below 4 GiB).
+#define PMEM_ZONE_DMA32     (1 << 1)
+/// @brief  Zone flags of pmem_alloc*: search the zones from the bottom up (bootstrapping).
+#define PMEM_BOTTOM_UP      (1 << 2)
+
+/// @brief  The first block behind ZONE_DMA (16 MiB).
+#define ZONE_DMA_END        (0x1000000 / PAGE_SIZE)
+/// @brief  The first block behind ZONE_NORMAL (4 GiB).
+#define ZONE_NORMAL_END     (0x100000000 / PAGE_SIZE)
+
+
+/// @brief  Allocator backends of the Physical Memory Manager.
+typedef enum PmemBackend {
+    PMEM_BITMAP,
+    PMEM_BUDDY
+} pmem_backend_t;
+
+/// @brief  Physical memory zones (general allocations are served from the highest one first).
+typedef enum PmemZoneType {
+    ZONE_DMA,
+    ZONE_NORMAL,
+    ZONE_HIGH,
+    MAX_ZONES
+} pmem_zone_type_t;
+
+/// @brief  A physical memory zone (range of blocks).
+typedef struct PmemZone {
+    const char *name;
+    u64 start;
+    /// exclusive
+    u64 end;
+    /// next fit hint of the bitmap allocator
+    u64 next;
+    /// usable pages at boot
+    u64 pages;
+} pmem_zone_t;
+
+
+extern pmem_backend_t pmem_backend;
 extern u64 kernel_region_end;
-extern u8 *bitmap;
+extern u64 *bitmap;
 extern u64 bitmap_byte_size;
 extern u64 bitmap_bit_size;
+extern u64 bitmap_word_size;
+extern u64 pmem_meta_pages;
 extern u64 blocks_allocated;
+extern u64 pmem_free_blocks;
+extern pmem_zone_t pmem_zones[MAX_ZONES];
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns the zone a block belongs to.
+///
+/// @param  block   The block (page frame number).
+///
+/// @returns    The zone type.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE u64 pmem_zone_of(u64 block) {
+
+    if (block < ZONE_DMA_END) return ZONE_DMA;
+    if (block < ZONE_NORMAL_END) return ZONE_NORMAL;
+    return ZONE_HIGH;
+}
 
 
 void pmem_init(void);
+u64 pmem_reclaim(void);
+u64 pmem_reclaim_range(u64 start_block, u64 end_block);
+void pmem_zone_init(void);
+u64 pmem_zone_nth(u64 flags, u64 n);
+u64 pmem_zone_find(pmem_zone_t *zone, u64 size);
+u64 pmem_zone_free_pages(pmem_zone_t *zone);
+void pmem_zone_print(void);
 
 range_t pmem_get_usable_mem_range(void);
 void pmem_bitmap_mark_block(u64 block, bool used);
 bool pmem_bitmap_get_block(u64 block);
 void pmem_bitmap_mark_blocks(u64 block, u64 count, bool used);
-u64 pmem_alloc(pt_t pt4, u64 size);
-u64 pmem_alloc_clean(pt_t pt4, u64 size);
-u64 pmem_alloc_raw(u64 size);
-void pmem_free(pt_t pt4, u64 block, u64 size);
-u64 pmem_find_free_region(u64 size);
+u64 pmem_count_bits(u64 word);
+u64 pmem_alloc(u64 size, u64 flags);
+u64 pmem_alloc_clean(u64 size, u64 flags);
+u64 pmem_alloc_raw(u64 size, u64 flags);
+void pmem_free(u64 block, u64 size);
+void pmem_free_batch(u64 *addrs, u64 count);
+void pmem_sort(u64 *addrs, u64 count);
+u64 pmem_reserve(u64 size, u64 flags);
+u64 pmem_reserve_reclaim(u64 size, u64 flags);
+void pmem_release(u64 block, u64 size);
+u64 pmem_reserve_direct(u64 size, u64 flags);
+void pmem_release_direct(u64 block, u64 size);
+u64 pmem_find_free_region(u64 size, u64 flags);
+u64 pmem_find_run(u64 from, u64 to, u64 size);
+u64 pmem_next_free_block(u64 block, u64 to);
+u64 pmem_next_used_block(u64 block, u64 to);
+
+bool pmem_summary_get(u64 *summary, u64 word);
+u64 pmem_summary_next_clear(u64 word);
+void pmem_summary_update(u64 word);
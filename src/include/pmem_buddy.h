@@ -0,0 +1,56 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Header file for the buddy backend of the Physical Memory Manager.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+
+#include <types.h>
+#include <pmem.h>
+
+
+#define PMEM_MAX_ORDER      10
+#define PMEM_ORDERS         (PMEM_MAX_ORDER + 1)
+
+#define FRAME_NIL           ((u32)-1)
+
+#define FRAME_FREE          (1 << 0)
+
+
+/// @brief  Per page frame data used by the buddy backend.
+typedef struct Frame {
+    u32 next;
+    u32 prev;
+    u8  order;
+    u8  flags;
+} frame_t;
+
+/// @brief  Fragmentation statistics of the buddy backend.
+typedef struct PmemBuddyStats {
+    u64 free_blocks[PMEM_ORDERS];
+    u64 free_pages;
+    u64 largest_order;
+    u64 zone_free_pages[MAX_ZONES];
+    /// unusable free space index per order in percent (0 = no fragmentation)
+    u64 frag_index[PMEM_ORDERS];
+} pmem_buddy_stats_t;
+
+
+extern frame_t *frames;
+
+
+void pmem_buddy_init(void);
+
+u64 pmem_buddy_alloc(u64 size, u64 flags);
+u64 pmem_buddy_zone_alloc(u64 zone, u64 size);
+void pmem_buddy_free(u64 block, u64 size);
+void pmem_buddy_carve(u64 block, u64 size);
+
+void pmem_buddy_push(u64 block, u64 order);
+void pmem_buddy_remove(u64 block);
+
+u64 pmem_buddy_order(u64 size);
+
+void pmem_buddy_stats(pmem_buddy_stats_t *stats);
+void pmem_buddy_print_stats(void);
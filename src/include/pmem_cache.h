@@ -0,0 +1,40 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Header file for the per-CPU page frame caches of the Physical Memory Manager.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+
+#include <types.h>
+#include <cpu.h>
+
+
+#define PMEM_CACHE_SIZE     64
+#define PMEM_CACHE_BATCH    32
+
+
+/// @brief  Magazine of free page frames owned by a single CPU.
+typedef struct ALIGNED(CACHE_LINE_SIZE) PmemCache {
+    u64 count;
+    u64 blocks[PMEM_CACHE_SIZE];
+
+    u64 hits;
+    u64 misses;
+    u64 refills;
+    u64 drains;
+} pmem_cache_t;
+
+
+extern pmem_cache_t pmem_caches[MAX_CPUS];
+extern bool pmem_cache_enabled;
+
+
+void pmem_cache_init(void);
+
+u64 pmem_cache_alloc(void);
+void pmem_cache_free(u64 block);
+void pmem_cache_refill(pmem_cache_t *cache);
+void pmem_cache_drain(pmem_cache_t *cache, u64 count);
+
+void pmem_cache_print_stats(void);
@@ -0,0 +1,19 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Header file for the page frame reference counts (shared copy-on-write frames).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+
+#include <types.h>
+
+
+/// @brief  Number of additional address spaces mapping each page frame (0 = not shared).
+extern u16 *pmem_refs;
+
+
+void pmem_ref_init(void);
+void pmem_ref_get(u64 paddr);
+void pmem_ref_put(u64 paddr);
+u64 pmem_ref_count(u64 paddr);
@@ -0,0 +1,40 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Header file for the cache shrinkers of the Physical Memory Manager.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+
+#include <types.h>
+
+
+#define PMEM_MAX_SHRINKERS      16
+
+/// @brief  The idle loop starts shrinking caches when fewer pages are free (4 MiB).
+#define PMEM_LOW_WATERMARK      1024
+/// @brief  The idle loop shrinks the caches until this many pages are free again (8 MiB).
+#define PMEM_HIGH_WATERMARK     2048
+
+
+/// @brief  A callback releasing memory held by a cache.
+typedef struct PmemShrinker {
+    const char *name;
+    /// releases up to the given number of pages, returns how many it freed
+    u64 (*shrink)(u64 pages);
+
+    u64 calls;
+    u64 freed;
+} pmem_shrinker_t;
+
+
+extern pmem_shrinker_t pmem_shrinkers[PMEM_MAX_SHRINKERS];
+extern u64 pmem_shrinkers_count;
+extern bool pmem_shrinking;
+
+
+void pmem_shrinker_register(const char *name, u64 (*shrink)(u64 pages));
+u64 pmem_shrink(u64 pages);
+void pmem_shrink_idle(void);
+
+void pmem_shrink_print_stats(void);
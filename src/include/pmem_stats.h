@@ -0,0 +1,58 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Header file for the accounting of the Physical Memory Manager.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+
+#include <types.h>
+#include <isr.h>
+#include <pmem.h>
+
+
+#define PMEM_STATS_TAGS     64
+
+/// @brief  Block tag of allocations that are not tracked (made before pmem_stats_init).
+#define PMEM_TAG_NONE       0
+/// @brief  Block tag shared by all callers once the tag table is full.
+#define PMEM_TAG_OTHER      (PMEM_STATS_TAGS - 1)
+
+
+/// @brief  Memory usage summary (also the layout returned by the SYS_MEMINFO syscall).
+typedef struct PmemInfo {
+    u64 total_pages;
+    u64 used_pages;
+    u64 free_pages;
+    /// pages handed out by pmem_alloc* and not freed yet
+    u64 allocated_pages;
+    u64 largest_free_run;
+    /// share of free memory outside of the largest free run in percent (0 = no fragmentation)
+    u64 frag_index;
+    u64 zone_free_pages[MAX_ZONES];
+} pmem_info_t;
+
+/// @brief  Allocations of one caller (identified by its return address).
+typedef struct PmemTag {
+    u64 caller;
+    u64 allocs;
+    u64 frees;
+    /// pages currently allocated
+    u64 pages;
+} pmem_tag_t;
+
+
+extern pmem_tag_t pmem_tags[PMEM_STATS_TAGS];
+extern u8 *pmem_block_tags;
+
+
+void pmem_stats_init(void);
+
+void pmem_stats_alloc(u64 caller, u64 block, u64 size);
+void pmem_stats_free(u64 block, u64 size);
+
+void pmem_stats_collect(pmem_info_t *info);
+u64 pmem_stats_largest_run(u64 from, u64 to, u64 *free);
+void pmem_stats_print(void);
+
+void sys_meminfo(int_args_t *args);
@@ -0,0 +1,37 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Header file for the pre-zeroed page frame pool of the Physical Memory Manager.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+
+#include <types.h>
+
+
+#define PMEM_ZERO_POOL_SIZE     256
+#define PMEM_ZERO_BATCH         16
+
+
+/// @brief  Pool of page frames that are already zero-initialized (reached through the direct map).
+typedef struct PmemZeroPool {
+    u64 count;
+    u64 blocks[PMEM_ZERO_POOL_SIZE];
+
+    u64 hits;
+    /// clean allocations zeroed synchronously (pool empty, several pages or a zone requested)
+    u64 fallbacks;
+    u64 zeroed;
+} pmem_zero_pool_t;
+
+
+extern pmem_zero_pool_t pmem_zero_pool;
+extern bool pmem_zero_enabled;
+
+
+void pmem_zero_init(void);
+void pmem_zero_idle(void);
+u64 pmem_zero_take(void);
+u64 pmem_zero_shrink(u64 pages);
+
+void pmem_zero_print_stats(void);
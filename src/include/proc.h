@@ -11,6 +11,8 @@
 #include <isr.h>
 #include <vfs.h>
 #include <alloc.h>
+#include <slab.h>
+#include <vma.h>
 
 
 #define MAX_NAME    16
@@ -33,6 +35,8 @@ typedef struct PCB {
     char            name[MAX_NAME];
     file_t          *file;
     pt_t            pt4;
+    /// memory of the process, mapped on demand (sorted by address)
+    vma_t           *vmas;
 
     proc_state_t    state;
     int_args_t      *ctx;
@@ -45,8 +49,13 @@ typedef struct PCB {
 
 
 void proc_init(void);
+void proc_pcb_ctor(void *obj);
 pcb_t *proc_create(allocator_t *allocator, pcb_t *parent, const char *name, u8 length, file_t *f);
+pcb_t *proc_fork(allocator_t *allocator, pcb_t *parent, int_args_t *ctx);
+void sys_fork(int_args_t *args);
 
 void switch_ctx(pcb_t *new);
 
 extern pcb_t *cur_proc;
+extern slab_allocator_t pcb_cache;
+extern alloc_stats_t pcb_cache_stats;
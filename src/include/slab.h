@@ -0,0 +1,78 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Header file for the slab allocator.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+
+#include <types.h>
+#include <paging.h>
+#include <alloc.h>
+#include <cpu.h>
+
+
+/// @brief  Header at the beginning of every slab (one page).
+typedef struct Slab {
+    struct SlabAllocator *cache;
+    /// the CPU whose free list the objects belong to
+    u64 cpu;
+    struct Slab *next;
+} slab_t;
+
+/// @brief  Per-CPU part of a slab allocator.
+typedef struct SlabCpu {
+    /// free objects, only touched by the owning CPU (0 = empty)
+    u64 free;
+    /// objects freed by other CPUs, lock-free stack taken over as a whole
+    u64 remote;
+
+    u64 allocs;
+    u64 frees;
+    u64 remote_frees;
+} ALIGNED(CACHE_LINE_SIZE) slab_cpu_t;
+
+/// @brief  Slab Allocator class (object cache for one type).
+typedef struct SlabAllocator {
+    allocator_t allocator;
+    const char *name;
+    u64 obj_size;
+    /// alignment of every object (a power of two, at least 8)
+    u64 align;
+    /// distance between two objects (object + free list link, rounded up to align)
+    u64 stride;
+    /// offset of the first object inside a slab
+    u64 offset;
+    /// called once per object when its slab is created (may be 0, free objects hold the link then)
+    void (*ctor)(void *obj);
+    slab_t *slabs;
+    slab_cpu_t cpus[MAX_CPUS];
+} slab_allocator_t;
+
+/// @brief  Object cache for objects of size bytes aligned to align bytes.
+#define CREATE_SLAB_ALLOCATOR(name, size, align, ctor) (slab_allocator_t) { \
+        (allocator_t) { \
+            0, \
+            0, \
+            0, \
+            slab_alloc, \
+            slab_free, \
+            slab_init, \
+            slab_size, \
+            slab_alloc_aligned \
+        }, name, size, align, 0, 0, ctor, 0, {} \
+    }; \
+
+
+/// @brief  Largest object size of a cache (a slab holds at least 7 objects of this size).
+#define SLAB_MAX_OBJ_SIZE   (PAGE_SIZE / 8)
+
+
+u64 slab_alloc(slab_allocator_t *self, u64 n_bytes);
+u64 slab_alloc_aligned(slab_allocator_t *self, u64 n_bytes, u64 align);
+void slab_free(slab_allocator_t *self, u64 vaddr);
+void slab_init(slab_allocator_t *self);
+u64 slab_size(slab_allocator_t *self, u64 vaddr);
+
+void slab_grow(slab_allocator_t *self, u64 cpu);
+void slab_print_stats(slab_allocator_t *self);
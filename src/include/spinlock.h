@@ -0,0 +1,54 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Contains a simple spinlock for data shared between CPUs.
+///
+/// @warning    Does not disable interrupts, data also used by interrupt handlers has to be
+///             locked with interrupts disabled (x86_irq_save).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+
+#include <types.h>
+#include <x86.h>
+
+
+/// @brief  Type of a spinlock (0 = unlocked).
+typedef u64 spinlock_t;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Acquires a spinlock, busy-waiting until it is free.
+///
+/// @param  lock    The lock.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE void spin_lock(spinlock_t *lock) {
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED)) x86_pause();
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Tries to acquire a spinlock without waiting.
+///
+/// @param  lock    The lock.
+///
+/// @returns    True if the lock was acquired.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE bool spin_trylock(spinlock_t *lock) {
+    return !__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Releases a spinlock.
+///
+/// @param  lock    The lock.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE void spin_unlock(spinlock_t *lock) {
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
@@ -8,7 +8,11 @@
 
 
 #define SYSCALL_VEC     128
-#define MAX_SYSCALL     0
+#define MAX_SYSCALL     16
+
+/// @brief  System call numbers (in the order syscall_init registers them).
+#define SYS_MEMINFO     0
+#define SYS_FORK        1
 
 
 void syscall_init(void);
@@ -0,0 +1,56 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Header file for the TLB invalidation (single pages, batches and shootdowns).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+
+#include <types.h>
+#include <paging.h>
+#include <cpu.h>
+
+
+/// @brief  A batch of more pages than this flushes the whole TLB instead of single pages.
+#define TLB_FLUSH_THRESHOLD 32
+
+
+/// @brief  Pages unmapped from an address space whose translations are invalidated together.
+typedef struct TlbGather {
+    /// the address space the pages were unmapped from
+    pt_t pt4;
+    /// pages added (more than TLB_FLUSH_THRESHOLD means a full flush)
+    u64 count;
+    /// a virtual address inside each page (huge pages are added once)
+    u64 vaddrs[TLB_FLUSH_THRESHOLD];
+    /// page tables freed after the flush (physical address, linked through their first entry)
+    u64 tables;
+} tlb_gather_t;
+
+/// @brief  Shootdown request posted to a CPU.
+typedef struct TlbShootdown {
+    /// the batch to invalidate (0 if no request is pending)
+    tlb_gather_t *gather;
+} ALIGNED(CACHE_LINE_SIZE) tlb_shootdown_t;
+
+
+extern tlb_shootdown_t tlb_shootdowns[MAX_CPUS];
+extern u64 tlb_cpus;
+extern u64 tlb_page_flushes;
+extern u64 tlb_full_flushes;
+extern u64 tlb_ipis;
+
+void tlb_gather_init(tlb_gather_t *gather, pt_t pt4);
+void tlb_gather_add(tlb_gather_t *gather, u64 vaddr);
+void tlb_gather_free_table(tlb_gather_t *gather, u64 paddr);
+void tlb_gather_flush(tlb_gather_t *gather);
+
+void tlb_flush_page(pt_t pt4, u64 vaddr);
+void tlb_flush_all(pt_t pt4);
+bool tlb_is_active(pt_t pt4);
+void tlb_invalidate(tlb_gather_t *gather);
+
+void tlb_shootdown(tlb_gather_t *gather);
+void tlb_shootdown_handler(void);
+void tlb_send_ipi(u64 cpu);
+void tlb_print_stats(void);
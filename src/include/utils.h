@@ -11,3 +11,4 @@
 
 void mem_set(u8 *dest, u8 val, u64 n_bytes);
 void mem_cpy(u8 *dest, u8 *src, u64 n_bytes);
+void mem_zero_pages(u8 *dest, u64 pages);
@@ -0,0 +1,69 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Header file for the virtual memory areas of user address spaces (demand paging).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#pragma once
+
+
+#include <types.h>
+#include <paging.h>
+#include <isr.h>
+#include <slab.h>
+
+
+/// @brief  Exception number of page faults.
+#define PAGE_FAULT_VEC  14
+
+/// @brief  Page fault error code: the page was present (protection violation).
+#define PF_PRESENT      (1 << 0)
+/// @brief  Page fault error code: the access was a write.
+#define PF_WRITE        (1 << 1)
+/// @brief  Page fault error code: the access came from user mode.
+#define PF_USER         (1 << 2)
+
+/// @brief  End of the user stack (it grows down from here).
+#define USER_STACK_TOP  0xbffff000
+/// @brief  Maximum size of the user stack in bytes.
+#define USER_STACK_MAX  0x800000
+
+
+/// @brief  How the pages of a virtual memory area are filled.
+typedef enum VmaType {
+    /// zero-initialized pages
+    VMA_ANON,
+    /// pages copied from a file (zero-initialized behind the file data)
+    VMA_FILE,
+    /// zero-initialized pages, grows down on faults below the area
+    VMA_STACK
+} vma_type_t;
+
+/// @brief  Virtual memory area of a process (pages are mapped by the page fault handler).
+typedef struct Vma {
+    struct Vma *next;
+    /// page aligned range [start, end)
+    u64 start;
+    u64 end;
+    /// attributes of the mapped pages
+    u64 flags;
+    vma_type_t type;
+    /// file contents at start (VMA_FILE only)
+    u8 *data;
+    /// how many bytes from start are backed by data
+    u64 data_size;
+    /// pages mapped by the page fault handler
+    u64 faults;
+} vma_t;
+
+
+extern slab_allocator_t vma_cache;
+
+void vma_init(void);
+vma_t *vma_add(vma_t **vmas, u64 start, u64 end, u64 flags, vma_type_t type);
+vma_t *vma_clone(vma_t *vmas);
+vma_t *vma_find(vma_t *vmas, u64 vaddr);
+vma_t *vma_grow_stack(vma_t *vmas, u64 vaddr);
+bool vma_fault(int_args_t *args);
+bool vma_user_writable(u64 vaddr, u64 size);
+u64 vma_load_page(vma_t *vma, u64 page);
+void vma_print(vma_t *vmas);
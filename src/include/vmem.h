@@ -8,6 +8,7 @@
 
 #include <types.h>
 #include <paging.h>
+#include <tlb.h>
 
 
 #define INDEX_PT1(vaddr)    ((vaddr >> 12) & 0x1ff)
@@ -15,16 +16,43 @@
 #define INDEX_PT3(vaddr)    ((vaddr >> 30) & 0x1ff)
 #define INDEX_PT4(vaddr)    ((vaddr >> 39) & 0x1ff)
 
+/// @brief  Number of entries in a page table of any level.
+#define PT_ENTRIES          512
+
+/// @brief  Size of the virtual range reserved for the kernel heap (one page directory).
+#define KERNEL_HEAP_SIZE    0x40000000
+
 
 extern pt_t kernel_pt4;
+extern u64 kernel_heap_base;
+extern u64 vmem_direct_pages[3];
+extern bool vmem_1g_pages;
 
 void vmem_map(pt_t pt4, u64 vaddr, u64 paddr, u64 flags);
 void vmem_map_raw(pt_t pt4, u64 vaddr, u64 paddr, u64 flags);
+void vmem_map_huge_raw(pt_t pt4, u64 vaddr, u64 paddr, u64 flags, u64 page_size);
+void vmem_map_direct(pt_t pt4, u64 base, u64 end);
 
 void vmem_map_region(pt_t pt4, u64 vaddr, u64 paddr, u64 flags, u64 blocks);
 void vmem_map_region_raw(pt_t pt4, u64 vaddr, u64 paddr, u64 flags, u64 blocks);
+pt_t vmem_next_table(pte_t *entry, u64 vaddr);
+bool vmem_can_promote(pte_t entry, u64 vaddr, u64 end, u64 offset, u64 flags, u64 page_size);
+u64 vmem_map_pt3(pt_t pt3, u64 vaddr, u64 end, u64 offset, u64 flags);
+u64 vmem_map_pt2(pt_t pt2, u64 vaddr, u64 end, u64 offset, u64 flags);
+u64 vmem_map_pt1(pt_t pt1, u64 vaddr, u64 end, u64 offset, u64 flags);
+
+pte_t *vmem_get_pte(pt_t pt4, u64 vaddr);
+bool vmem_is_mapped(pt_t pt4, u64 vaddr);
+u64 vmem_translate(pt_t pt4, u64 vaddr);
 
 void vmem_unmap(pt_t pt4, u64 vaddr);
 void vmem_unmap_region(pt_t pt4, u64 vaddr, u64 blocks);
+pt_t vmem_mapped_table(pte_t entry, u64 vaddr);
+u64 vmem_unmap_pt3(tlb_gather_t *tlb, pt_t pt3, u64 vaddr, u64 end);
+u64 vmem_unmap_pt2(tlb_gather_t *tlb, pt_t pt2, u64 vaddr, u64 end);
+u64 vmem_unmap_pt1(tlb_gather_t *tlb, pt_t pt1, u64 vaddr, u64 end);
 u64 vmem_create_address_space(void);
+u64 vmem_clone_address_space(pt_t pt4);
+void vmem_clone_table(pt_t dst, pt_t src, u64 level, u64 first, u64 last);
+bool vmem_cow_fault(pt_t pt4, u64 vaddr);
 void vmem_init(void);
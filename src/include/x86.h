@@ -15,6 +15,21 @@
 
 #define ASM __asm__ __volatile__
 
+/// @brief  Interrupt enable flag in rflags.
+#define RFLAGS_IF   (1 << 9)
+
+/// @brief  Write protect flag in cr0 (supervisor writes to read-only pages fault as well).
+#define CR0_WP      (1 << 16)
+/// @brief  Page global enable flag in cr4 (PAGE_GLOBAL entries survive a cr3 reload).
+#define CR4_PGE     (1 << 7)
+
+/// @brief  cpuid leaf returning the highest extended leaf.
+#define CPUID_EXT_MAX       0x80000000
+/// @brief  cpuid leaf returning the extended feature flags.
+#define CPUID_EXT_FEATURES  0x80000001
+/// @brief  1 GiB page support (edx of CPUID_EXT_FEATURES).
+#define CPUID_PDPE1GB       (1 << 26)
+
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 /// @brief  Reads a byte of data from an I/O port.
@@ -100,6 +115,39 @@ static INLINE void x86_sti(void) {
 }
 
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Disables interrupts and returns the previous state.
+///
+/// @returns    The rflags register before disabling interrupts (for x86_irq_restore).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE u64 x86_irq_save(void) {
+    u64 rflags;
+    ASM("pushfq; pop %0; cli" : "=r" (rflags) : : "memory");
+    return rflags;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Reenables interrupts if they were enabled before x86_irq_save.
+///
+/// @param  rflags  The value returned by x86_irq_save.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE void x86_irq_restore(u64 rflags) {
+    if (rflags & RFLAGS_IF) x86_sti();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Hints the CPU that it is spinning in a busy-wait loop.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE void x86_pause(void) {
+    ASM("pause" : : : "memory");
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 /// @brief  Pauses the CPU.
 ///
@@ -145,6 +193,95 @@ static INLINE void x86_invlpg(u64 vaddr) {
 }
 
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Reads the Time Stamp Counter.
+///
+/// @returns    The number of cycles since reset.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE u64 x86_rdtsc(void) {
+    u32 high, low;
+    ASM("rdtsc" : "=a" (low), "=d" (high) : : "memory");
+    return ((u64)high << 32) | low;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Executes the cpuid instruction.
+///
+/// @param  leaf    The leaf to query (eax, the subleaf ecx is 0).
+/// @param  regs    Receives eax, ebx, ecx and edx (in this order).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE void x86_cpuid(u32 leaf, u32 regs[4]) {
+    ASM("cpuid"
+            : "=a" (regs[0]), "=b" (regs[1]), "=c" (regs[2]), "=d" (regs[3])
+            : "a" (leaf), "c" (0));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Checks if the CPU supports 1 GiB pages.
+///
+/// @returns    True if 3rd level page table entries can map 1 GiB pages.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE bool x86_has_1g_pages(void) {
+
+    u32 regs[4];
+
+    x86_cpuid(CPUID_EXT_MAX, regs);
+    if (regs[0] < CPUID_EXT_FEATURES) return false;
+
+    x86_cpuid(CPUID_EXT_FEATURES, regs);
+    return (regs[3] & CPUID_PDPE1GB) != 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Invalidates all non-global TLB entries.
+///
+/// Reloads the cr3 register with its current value.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE void x86_flush_tlb(void) {
+    u64 cr3;
+    ASM("mov %0, cr3" : "=r" (cr3) : : "memory");
+    ASM("mov cr3, %0" : : "r" (cr3) : "memory");
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Invalidates all TLB entries (global entries included).
+///
+/// Toggles the page global enable flag if it is set, otherwise reloads the cr3 register.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE void x86_flush_tlb_global(void) {
+    u64 cr4;
+    ASM("mov %0, cr4" : "=r" (cr4) : : "memory");
+
+    if (!(cr4 & CR4_PGE)) {
+        x86_flush_tlb();
+        return;
+    }
+
+    ASM("mov cr4, %0" : : "r" (cr4 & ~CR4_PGE) : "memory");
+    ASM("mov cr4, %0" : : "r" (cr4) : "memory");
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns the physical address of the loaded PML4T.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE u64 x86_read_cr3(void) {
+    u64 cr3;
+    ASM("mov %0, cr3" : "=r" (cr3) : : "memory");
+    return cr3 & ~0xfffull;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 /// @brief  Changes the stack pointer to a new stack.
 ///
@@ -179,6 +316,29 @@ static INLINE void x86_load_pt4(pt_t pt4) {
     ASM("mov cr3, %0" : : "r" (pt4) : "memory");
 }
 
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns the current value of the cr0 register.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE u64 x86_read_cr0(void) {
+    u64 cr0;
+    ASM("mov %0, cr0" : "=r" (cr0) : : "memory");
+    return cr0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Writes the cr0 register.
+///
+/// @param  cr0     The new value.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static INLINE void x86_write_cr0(u64 cr0) {
+    ASM("mov cr0, %0" : : "r" (cr0) : "memory");
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 /// @brief  Reads a Model Specific Register (MSR).
 ///
@@ -0,0 +1,561 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Contains in-kernel benchmarks for the memory managers.
+///
+/// Results are written to the debug port.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <types.h>
+#include <bench.h>
+#include <paging.h>
+#include <pmem.h>
+#include <pmem_buddy.h>
+#include <pmem_cache.h>
+#include <pmem_zero.h>
+#include <vmem.h>
+#include <utils.h>
+#include <dbg.h>
+#include <x86.h>
+#include <err.h>
+#include <tty.h>
+#include <buddy.h>
+
+
+/// @brief  Allocations kept alive during the physical memory benchmark (start block, size).
+u64 bench_live[BENCH_PMEM_LIVE][2];
+
+/// @brief  Next fit position of the reference allocator.
+u64 bench_linear_next = 0;
+
+/// @brief  Allocations kept alive during the heap benchmark (address).
+u64 bench_heap_live[BENCH_HEAP_LIVE];
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Runs all benchmarks.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void bench_run(void) {
+
+    dbg_info("Running benchmarks...\n");
+    bench_pmem();
+    bench_pmem_fill(10);
+    bench_pmem_fill(50);
+    bench_pmem_fill(95);
+    bench_heap();
+    bench_buddy();
+    bench_vmem();
+    dbg_info("Benchmarks done\n");
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Reference allocator: the plain bit-by-bit next fit scan.
+///
+/// @param  size    The size of the requested region.
+///
+/// @returns    The start block of the found region or -1 if no region could be found.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 bench_linear_find(u64 size) {
+
+    if (bench_linear_next > 0 && !pmem_bitmap_get_block(bench_linear_next - 1)) 
+        bench_linear_next = 0;
+
+    u64 cur_size = 0;
+    u64 cur_start = bench_linear_next % bitmap_bit_size;
+    u64 cur_block = 0;
+
+    for (u64 i = 0; i < bitmap_bit_size; i++) {
+
+        cur_block = (bench_linear_next + i) % bitmap_bit_size;
+
+        if (cur_block == 0) {
+            cur_size = 0;
+            cur_start = 0;
+        }
+
+        if (pmem_bitmap_get_block(cur_block)) {
+            cur_size = 0;
+            cur_start = cur_block + 1;
+        } else {
+
+            cur_size++;
+            if (cur_size >= size) {
+                bench_linear_next = (cur_start + 1) % bitmap_bit_size;
+                return cur_start;
+            }
+        }
+    }
+
+    return -1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Reserves a region found by the reference allocator in the bitmap.
+///
+/// @param  size    The size of the requested region.
+/// @param  flags   Ignored (the reference allocator doesn't know zones).
+///
+/// @returns    The start block of the region or -1 if no region could be found.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 bench_linear_alloc(u64 size, u64 flags) {
+
+    u64 block = bench_linear_find(size);
+    if (block != (u64)-1) pmem_bitmap_mark_blocks(block, size, true);
+    return block;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Reserves a region found by the summary index search in the bitmap.
+///
+/// @param  size    The size of the requested region.
+/// @param  flags   The zone flags (PMEM_ZONE_*).
+///
+/// @returns    The start block of the region or -1 if no region could be found.
+///
+/// Bypasses the active backend so the bitmap search is measured on its own.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 bench_summary_alloc(u64 size, u64 flags) {
+
+    u64 block = pmem_find_free_region(size, flags);
+    if (block != (u64)-1) pmem_bitmap_mark_blocks(block, size, true);
+    return block;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Releases a region reserved by bench_linear_alloc or bench_summary_alloc.
+///
+/// @param  block   The first block of the region.
+/// @param  size    The size of the region.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void bench_bitmap_free(u64 block, u64 size) {
+
+    pmem_bitmap_mark_blocks(block, size, false);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Runs alloc/free cycles against the physical memory allocator.
+///
+/// @param  alloc   The function reserving a region.
+/// @param  free    The function releasing a region.
+///
+/// @returns    The number of cycles spent.
+///
+/// Keeps BENCH_PMEM_LIVE allocations alive and replaces the oldest one every cycle.
+/// Every 16th allocation is a contiguous region of up to 32 pages.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 bench_pmem_cycles(u64 (*alloc)(u64, u64), void (*free)(u64, u64)) {
+
+    u64 size;
+    u64 block;
+    u64 slot;
+
+    for (u64 i = 0; i < BENCH_PMEM_LIVE; i++) bench_live[i][1] = 0;
+
+    u64 start = x86_rdtsc();
+
+    for (u64 i = 0; i < BENCH_PMEM_CYCLES; i++) {
+
+        slot = i % BENCH_PMEM_LIVE;
+        if (bench_live[slot][1]) free(bench_live[slot][0], bench_live[slot][1]);
+
+        size = (i % 16 == 0) ? 1 + (i / 16) % 32 : 1;
+        block = alloc(size, PMEM_ZONE_ANY);
+        if (block == (u64)-1) {
+            bench_live[slot][1] = 0;
+            continue;
+        }
+
+        bench_live[slot][0] = block;
+        bench_live[slot][1] = size;
+    }
+
+    u64 cycles = x86_rdtsc() - start;
+
+    for (u64 i = 0; i < BENCH_PMEM_LIVE; i++) {
+        if (bench_live[i][1]) free(bench_live[i][0], bench_live[i][1]);
+    }
+
+    return cycles;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Compares the summary index search with the plain next fit scan and the active backend.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void bench_pmem(void) {
+
+    u64 linear = bench_pmem_cycles(bench_linear_alloc, bench_bitmap_free);
+    u64 summary = bench_pmem_cycles(bench_summary_alloc, bench_bitmap_free);
+    u64 backend = bench_pmem_cycles(pmem_reserve, pmem_release);
+
+    dbg_info("pmem: %u alloc/free cycles over %u pages\n", BENCH_PMEM_CYCLES, bitmap_bit_size);
+    dbg_info("pmem: next fit scan   %u cycles (%u per cycle)\n", 
+            linear, linear / BENCH_PMEM_CYCLES);
+    dbg_info("pmem: summary index   %u cycles (%u per cycle)\n", 
+            summary, summary / BENCH_PMEM_CYCLES);
+    dbg_info("pmem: %s backend   %u cycles (%u per cycle)\n", 
+            pmem_backend == PMEM_BUDDY ? "buddy " : "bitmap",
+            backend, backend / BENCH_PMEM_CYCLES);
+
+    if (pmem_backend == PMEM_BUDDY) pmem_buddy_print_stats();
+    pmem_cache_print_stats();
+    pmem_zero_print_stats();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Measures the cost of single page and contiguous allocations at a given memory fill.
+///
+/// @param  percent     How much of the unused memory should be marked used (pseudo-randomly).
+///
+/// The bitmap is saved before and restored after the measurement.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void bench_pmem_fill(u64 percent) {
+
+    u64 snap_pages = page_round_up(bitmap_byte_size);
+    u64 snap_addr = pmem_alloc(snap_pages, PMEM_ZONE_ANY);
+    mem_cpy((u8*)P2V(snap_addr), (u8*)bitmap, bitmap_byte_size);
+
+    // fill the unused memory with a reproducible pattern of used and unused chunks
+    u64 seed = 1;
+    for (u64 block = 0; block < bitmap_bit_size; block++) {
+
+        if (block % BENCH_PMEM_FILL_CHUNK == 0)
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        if ((seed >> 33) % 100 < percent) pmem_bitmap_mark_block(block, true);
+    }
+
+    u64 block;
+    u64 failed = 0;
+    u64 start = x86_rdtsc();
+    for (u64 i = 0; i < BENCH_PMEM_FILL_ALLOCS; i++) {
+
+        block = pmem_find_free_region(1, PMEM_ZONE_ANY);
+        if (block == (u64)-1) { failed++; continue; }
+        pmem_bitmap_mark_block(block, true);
+        pmem_bitmap_mark_block(block, false);
+    }
+    u64 single = (x86_rdtsc() - start) / BENCH_PMEM_FILL_ALLOCS;
+
+    start = x86_rdtsc();
+    for (u64 i = 0; i < BENCH_PMEM_FILL_ALLOCS; i++) {
+
+        block = pmem_find_free_region(BENCH_PMEM_FILL_RUN, PMEM_ZONE_ANY);
+        if (block == (u64)-1) { failed++; continue; }
+        pmem_bitmap_mark_blocks(block, BENCH_PMEM_FILL_RUN, true);
+        pmem_bitmap_mark_blocks(block, BENCH_PMEM_FILL_RUN, false);
+    }
+    u64 run = (x86_rdtsc() - start) / BENCH_PMEM_FILL_ALLOCS;
+
+    // restore the bitmap and rebuild the summaries
+    mem_cpy((u8*)bitmap, (u8*)P2V(snap_addr), bitmap_byte_size);
+    for (u64 word = 0; word < bitmap_word_size; word++) pmem_summary_update(word);
+    pmem_free(snap_addr, snap_pages);
+
+    dbg_info("pmem: %u%% fill: %u cycles per page, %u cycles per %u page run (%u failed)\n",
+            percent, single, run, BENCH_PMEM_FILL_RUN, failed);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Compares the free list buddy heap with the bitmap scanning reference on a mixed 
+///         workload of 8 to 2048 byte allocations.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void bench_heap(void) {
+
+    buddy_allocator_t heap = CREATE_BUDDY_ALLOCATOR(BENCH_HEAP_PAGES);
+    heap.allocator.init(&heap);
+    u64 lists = bench_heap_cycles(&heap, buddy_alloc, buddy_free);
+    pmem_free(V2P(heap.allocator.base_addr), BENCH_HEAP_PAGES);
+
+    heap = CREATE_BUDDY_ALLOCATOR(BENCH_HEAP_PAGES);
+    heap.allocator.init(&heap);
+    u64 scan = bench_heap_cycles(&heap, bench_heap_scan_alloc, bench_heap_scan_free);
+    pmem_free(V2P(heap.allocator.base_addr), BENCH_HEAP_PAGES);
+
+    dbg_info("heap: %u alloc/free cycles, %u live, %u pages\n", 
+            BENCH_HEAP_OPS, BENCH_HEAP_LIVE, BENCH_HEAP_PAGES);
+    dbg_info("heap: bitmap scan   %u cycles (%u per cycle)\n", scan, scan / BENCH_HEAP_OPS);
+    dbg_info("heap: free lists    %u cycles (%u per cycle)\n", lists, lists / BENCH_HEAP_OPS);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Runs alloc/free cycles against a heap allocator.
+///
+/// @param  heap    The heap to use.
+/// @param  alloc   The allocation function.
+/// @param  free    The free function.
+///
+/// @returns    The number of cycles spent.
+///
+/// Keeps BENCH_HEAP_LIVE allocations alive and replaces a pseudo-random one every cycle.
+/// The sizes are spread evenly over the layers (8 to 2048 bytes, not only powers of two).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 bench_heap_cycles(
+        buddy_allocator_t *heap, 
+        u64 (*alloc)(buddy_allocator_t*, u64), 
+        void (*free)(buddy_allocator_t*, u64)) {
+
+    u64 seed = 1;
+    u64 slot;
+    u64 size;
+
+    for (u64 i = 0; i < BENCH_HEAP_LIVE; i++) bench_heap_live[i] = 0;
+
+    u64 start = x86_rdtsc();
+
+    for (u64 i = 0; i < BENCH_HEAP_OPS; i++) {
+
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        slot = (seed >> 33) % BENCH_HEAP_LIVE;
+        size = 1 + (seed >> 45) % (SMALLEST << ((seed >> 40) % 9));
+
+        if (bench_heap_live[slot]) free(heap, bench_heap_live[slot]);
+        bench_heap_live[slot] = alloc(heap, size);
+    }
+
+    for (u64 i = 0; i < BENCH_HEAP_LIVE; i++) {
+        if (bench_heap_live[i]) free(heap, bench_heap_live[i]);
+    }
+
+    return x86_rdtsc() - start;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Reference heap allocator: scans the bitmap of every page for a free buddy.
+///
+/// @param  self    A pointer to the Buddy Allocator Structure.
+/// @param  n_bytes How many bytes to allocate.
+/// 
+/// @returns    The pointer to the allocated memory.
+///
+/// The former buddy_alloc (with the page offset added to the result, which it was missing),
+/// only works with bench_heap_scan_free (ignores the free lists).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 bench_heap_scan_alloc(buddy_allocator_t *self, u64 n_bytes) {
+
+    u8 *bitmap;
+    u64 layer;
+    u64 layer_off;
+    u64 layer_size;
+    bool buddy1;
+    bool buddy2;
+
+    u64 best_layer = buddy_layer_from_size(n_bytes);
+
+    for (u64 page = 0; page < self->allocator.blocks; page++) {
+    
+        bitmap = (u8*)self->allocator.base_addr + page * PAGE_SIZE;
+        layer = best_layer;
+
+        for (; layer > 0; layer--) {
+        
+            layer_off = buddy_bit_offset_layer(layer);
+            layer_size = buddy_bits_in_layer(layer);
+
+            for (u64 off = layer_off; off < layer_off + layer_size; off += 2) {
+
+                buddy1 = buddy_bitmap_get_bit(bitmap, off);
+                buddy2 = buddy_bitmap_get_bit(bitmap, off + 1);
+                if (!(buddy1 ^ buddy2)) continue;
+
+                off += buddy1;
+                buddy_bitmap_mark_bit(bitmap, off, true);
+                off -= layer_off;
+
+                while (layer != best_layer) {
+                    layer++;
+                    off *= 2;
+                    buddy_bitmap_mark_bit(bitmap, buddy_bit_offset_layer(layer) + off, true);
+                }
+
+                return (u64)bitmap + off * buddy_layer_block_size(layer);
+            }
+        }
+    }
+
+    panic("Buddy Allocator: out of memory\n");
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Reference heap free: the former buddy_free (bitmap only).
+///
+/// @param  self    The Buddy Allocator that was used for allocating.
+/// @param  vaddr   The start address of the memory to free.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void bench_heap_scan_free(buddy_allocator_t *self, u64 vaddr) {
+
+    u64 off;
+    u64 off_in_page = vaddr % PAGE_SIZE;
+    u8 *bitmap = (u8*)(vaddr - off_in_page);
+
+    for (
+            u64 layer = LAYERS - 1; 
+            (off_in_page % buddy_layer_block_size(layer) == 0) && (layer > 0); 
+            layer--) {
+
+        off = off_in_page / buddy_layer_block_size(layer);
+        if (!buddy_bitmap_get_bit(bitmap, buddy_bit_offset_layer(layer) + off)) continue;
+
+        mem_set((u8*)vaddr, 0, buddy_layer_block_size(layer));
+
+        while (true) {
+
+            buddy_bitmap_mark_bit(bitmap, buddy_bit_offset_layer(layer) + off, false);
+            if (buddy_bitmap_get_bit(bitmap, buddy_bit_offset_layer(layer) + (off ^ 1))) return;
+
+            off /= 2;
+            layer--;
+        }
+    }
+
+    panic("Buddy Allocator: there is no block used\n");
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Measures the cycles per buddy_alloc and buddy_free call for every block size.
+///
+/// Every round allocates BENCH_HEAP_LIVE blocks of the same size and frees them again, so both
+/// calls split and merge blocks the whole way between the layer and the free page halves.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void bench_buddy(void) {
+
+    buddy_allocator_t heap = CREATE_BUDDY_ALLOCATOR(BENCH_HEAP_PAGES);
+    heap.allocator.init(&heap);
+
+    u64 start;
+    u64 alloc;
+    u64 free;
+
+    for (u64 size = SMALLEST; size <= GREATEST / 2; size *= 2) {
+
+        alloc = 0;
+        free = 0;
+
+        for (u64 round = 0; round < BENCH_BUDDY_ROUNDS; round++) {
+
+            start = x86_rdtsc();
+            for (u64 i = 0; i < BENCH_HEAP_LIVE; i++) 
+                bench_heap_live[i] = buddy_alloc(&heap, size);
+            alloc += x86_rdtsc() - start;
+
+            start = x86_rdtsc();
+            for (u64 i = 0; i < BENCH_HEAP_LIVE; i++) buddy_free(&heap, bench_heap_live[i]);
+            free += x86_rdtsc() - start;
+        }
+
+        dbg_info("buddy: %u bytes: %u cycles per alloc, %u cycles per free\n",
+                size,
+                alloc / (BENCH_BUDDY_ROUNDS * BENCH_HEAP_LIVE),
+                free / (BENCH_BUDDY_ROUNDS * BENCH_HEAP_LIVE));
+    }
+
+    pmem_free(V2P(heap.allocator.base_addr), BENCH_HEAP_PAGES);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Compares mapping and unmapping 1 GiB page by page with the range page table walker.
+///
+/// The mappings go into a private address space that is never loaded, nothing is accessed.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void bench_vmem(void) {
+
+    pt_t pt4 = (pt_t)P2V(pmem_alloc_clean(1, PMEM_ZONE_ANY));
+
+    u64 start = x86_rdtsc();
+    for (u64 page = 0; page < BENCH_VMEM_PAGES; page++)
+        vmem_map(pt4, page * PAGE_SIZE, page * PAGE_SIZE, PAGE_WRITE);
+    u64 map = x86_rdtsc() - start;
+
+    start = x86_rdtsc();
+    for (u64 page = 0; page < BENCH_VMEM_PAGES; page++) vmem_unmap(pt4, page * PAGE_SIZE);
+    u64 unmap = x86_rdtsc() - start;
+
+    bench_vmem_free_tables(pt4);
+
+    dbg_info("vmem: %u pages, 1 GiB pages %s\n",
+            BENCH_VMEM_PAGES, vmem_1g_pages ? "supported" : "not supported");
+    dbg_info("vmem: page by page  map %u cycles, unmap %u cycles\n", map, unmap);
+
+    bench_vmem_region(pt4, PAGE_WRITE, "range 4 KiB ");
+    bench_vmem_region(pt4, PAGE_WRITE | PAGE_HUGE, "range huge  ");
+
+    pmem_free(V2P(pt4), 1);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Measures vmem_map_region and vmem_unmap_region for the benchmark mapping.
+///
+/// @param  pt4     The private address space.
+/// @param  flags   The flags passed to vmem_map_region.
+/// @param  name    The name of the measurement.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void bench_vmem_region(pt_t pt4, u64 flags, const char *name) {
+
+    u64 start = x86_rdtsc();
+    vmem_map_region(pt4, 0, 0, flags, BENCH_VMEM_PAGES);
+    u64 map = x86_rdtsc() - start;
+
+    start = x86_rdtsc();
+    vmem_unmap_region(pt4, 0, BENCH_VMEM_PAGES);
+    u64 unmap = x86_rdtsc() - start;
+
+    bench_vmem_free_tables(pt4);
+
+    dbg_info("vmem: %s map %u cycles, unmap %u cycles\n", name, map, unmap);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Frees the page tables of the benchmark mapping (the first 512 GiB).
+///
+/// @param  pt4     The private address space (all pages have to be unmapped).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void bench_vmem_free_tables(pt_t pt4) {
+
+    if (!GET_FLAG(pt4[0], PAGE_PRESENT)) return;
+
+    pt_t pt3 = (pt_t)P2V(ADDRESS(pt4[0]));
+    pt_t pt2;
+
+    for (u64 i = 0; i < PT_ENTRIES; i++) {
+
+        if (!GET_FLAG(pt3[i], PAGE_PRESENT)) continue;
+
+        pt2 = (pt_t)P2V(ADDRESS(pt3[i]));
+        for (u64 j = 0; j < PT_ENTRIES; j++) {
+            if (GET_FLAG(pt2[j], PAGE_PRESENT)) pmem_free(ADDRESS(pt2[j]), 1);
+        }
+
+        pmem_free(ADDRESS(pt3[i]), 1);
+    }
+
+    pmem_free(ADDRESS(pt4[0]), 1);
+    pt4[0] = 0;
+}
@@ -15,6 +15,7 @@
 #include <pmem.h>
 #include <tty.h>
 #include <paging.h>
+#include <vma.h>
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -53,30 +54,46 @@ void elf64_check(file_t *f) {
 /// @brief  Extracts an ELF64 file of a new process onto a new address space.
 ///
 /// @param  proc    The process to extract.
+///
+/// Every loadable segment becomes a file backed virtual memory area, nothing is mapped yet.
+/// The page fault handler copies the pages on first access and zero-fills the part of the
+/// segment that is not in the file (.bss).
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 void elf64_extract(pcb_t *proc) {
 
     elf_header_64_t *elf = (elf_header_64_t*)proc->file->data;
     elf_pheader_64_t *pheaders = (elf_pheader_64_t*)(proc->file->data + elf->pht_off);
+
+    u64 flags;
+    u64 lead;
+    vma_t *vma;
     
     for (u64 i = 0; i < elf->pht_entries; i++) {
 
-        if (pheaders[i].size_mem != pheaders[i].size_file) 
-            panic("Additional memory has to be allocated!\n");
         if (pheaders[i].type != SEG_LOAD) continue;
+        if (pheaders[i].size_file > pheaders[i].size_mem)
+            panic("Segment is bigger in the file than in memory!\n");
         
 //        tty_putf(WHITE_ON_BLACK, "%u: %x - %x\n", pheaders[i].type, pheaders[i].vaddr, pheaders[i].vaddr + pheaders[i].size_mem);
 
         
 //        tty_putf(WHITE_ON_BLACK, "%x\n", pheaders[i].flags);
 
-        vmem_map_region(
-                proc->pt4, 
-                pheaders[i].vaddr, 
-                V2P(proc->file->data) + pheaders[i].off, 
-                PAGE_USER | PAGE_WRITE | PAGE_PRESENT,
-                page_round_up(pheaders[i].size_mem)
-            );
+        flags = PAGE_USER;
+        if (pheaders[i].flags & ELF_SEG_WRITE) flags |= PAGE_WRITE;
+
+        vma = vma_add(
+                &proc->vmas,
+                pheaders[i].vaddr,
+                pheaders[i].vaddr + pheaders[i].size_mem,
+                flags,
+                VMA_FILE);
+
+        // the area starts at a page boundary, the bytes in front of the segment are taken from
+        // the file as well (the offset and the address are congruent modulo the page size)
+        lead = pheaders[i].vaddr % PAGE_SIZE;
+        vma->data = proc->file->data + pheaders[i].off - lead;
+        vma->data_size = pheaders[i].size_file + lead;
     }
 }
@@ -0,0 +1,230 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Statistics and tracing for any allocator.
+///
+/// alloc_stats_enable puts counting functions in front of the alloc and free functions of an
+/// allocator, so every caller going through the allocator_t functions is accounted without
+/// changes. Allocators without the extension pay nothing. When built with -DALLOC_TRACE the
+/// last ALLOC_TRACE_SIZE events are kept together with the caller addresses, which can be
+/// resolved with addr2line on the kernel ELF.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <types.h>
+#include <paging.h>
+#include <alloc.h>
+#include <pmem.h>
+#include <vmem.h>
+#include <x86.h>
+#include <dbg.h>
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns the histogram class of an allocation size.
+///
+/// @param  n_bytes The requested size.
+///
+/// @returns    0 for up to 8 bytes, 1 for up to 16 bytes and so on.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 alloc_stats_class(u64 n_bytes) {
+
+    if (n_bytes <= 8) return 0;
+
+    u64 class = 64 - __builtin_clzll(n_bytes - 1) - 3;
+    return class < ALLOC_HISTOGRAM_SIZE ? class : ALLOC_HISTOGRAM_SIZE - 1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Records an event in the trace of an allocator.
+///
+/// @param  stats   The statistics of the allocator.
+/// @param  caller  The return address of the alloc/free call.
+/// @param  vaddr   The address of the block.
+/// @param  n_bytes The requested size (0 for frees).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void alloc_trace_record(alloc_stats_t *stats, u64 caller, u64 vaddr, u64 n_bytes) {
+
+    u64 slot = __atomic_fetch_add(&stats->trace_next, 1, __ATOMIC_RELAXED) % ALLOC_TRACE_SIZE;
+
+    stats->trace[slot] = (alloc_event_t) { x86_rdtsc(), caller, vaddr, n_bytes };
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Enables statistics (and tracing) for an allocator.
+///
+/// @param  allocator   The initialized allocator.
+/// @param  stats       Zeroed storage for the statistics (has to stay valid).
+/// @param  name        The name used when printing the statistics.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void alloc_stats_enable(allocator_t *allocator, alloc_stats_t *stats, const char *name) {
+
+    // wrapping twice would make the counting functions call themselves
+    if (allocator->stats) return;
+
+    stats->name = name;
+    stats->alloc = allocator->alloc;
+    stats->free = allocator->free;
+    stats->alloc_aligned = allocator->alloc_aligned;
+
+#ifdef ALLOC_TRACE
+    stats->trace = (alloc_event_t*)P2V(pmem_alloc_clean(
+                page_round_up(ALLOC_TRACE_SIZE * sizeof(alloc_event_t)),
+                PMEM_ZONE_ANY));
+#endif
+
+    allocator->stats = stats;
+    allocator->alloc = alloc_stats_alloc;
+    allocator->free = alloc_stats_free;
+    if (allocator->alloc_aligned) allocator->alloc_aligned = alloc_stats_alloc_aligned;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates memory and counts the allocation.
+///
+/// @param  self    The allocator (with statistics enabled).
+/// @param  n_bytes How many bytes to allocate.
+///
+/// @returns    The pointer returned by the allocator.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 alloc_stats_alloc(allocator_t *self, u64 n_bytes) {
+
+    u64 vaddr = self->stats->alloc(self, n_bytes);
+    alloc_stats_count(self, vaddr, n_bytes, (u64)__builtin_return_address(0));
+    return vaddr;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates aligned memory and counts the allocation.
+///
+/// @param  self    The allocator (with statistics enabled).
+/// @param  n_bytes How many bytes to allocate.
+/// @param  align   The alignment.
+///
+/// @returns    The pointer returned by the allocator.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 alloc_stats_alloc_aligned(allocator_t *self, u64 n_bytes, u64 align) {
+
+    u64 vaddr = self->stats->alloc_aligned(self, n_bytes, align);
+    alloc_stats_count(self, vaddr, n_bytes, (u64)__builtin_return_address(0));
+    return vaddr;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Counts an allocation.
+///
+/// @param  self    The allocator (with statistics enabled).
+/// @param  vaddr   The pointer returned by the allocator (0 if it failed).
+/// @param  n_bytes The requested size.
+/// @param  caller  The return address of the alloc call.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void alloc_stats_count(allocator_t *self, u64 vaddr, u64 n_bytes, u64 caller) {
+
+    alloc_stats_t *stats = self->stats;
+
+    if (!vaddr) {
+        __atomic_fetch_add(&stats->failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    __atomic_fetch_add(&stats->allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->histogram[alloc_stats_class(n_bytes)], 1, __ATOMIC_RELAXED);
+
+    if (self->size) {
+
+        u64 live = __atomic_add_fetch(
+                &stats->bytes_live, self->size(self, vaddr), __ATOMIC_RELAXED);
+
+        // not exact when several CPUs race, good enough for a high-water mark
+        if (live > stats->bytes_peak) stats->bytes_peak = live;
+    }
+
+    if (stats->trace) alloc_trace_record(stats, caller, vaddr, n_bytes);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Frees memory and counts the free.
+///
+/// @param  self    The allocator (with statistics enabled).
+/// @param  vaddr   The start address of the memory to free.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void alloc_stats_free(allocator_t *self, u64 vaddr) {
+
+    alloc_stats_t *stats = self->stats;
+
+    // the size has to be read while the block is still allocated
+    if (self->size)
+        __atomic_fetch_sub(&stats->bytes_live, self->size(self, vaddr), __ATOMIC_RELAXED);
+
+    stats->free(self, vaddr);
+    __atomic_fetch_add(&stats->frees, 1, __ATOMIC_RELAXED);
+
+    if (stats->trace) alloc_trace_record(stats, (u64)__builtin_return_address(0), vaddr, 0);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Writes the statistics of an allocator to debug.
+///
+/// @param  allocator   The allocator (nothing is written if statistics are disabled).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void alloc_stats_print(allocator_t *allocator) {
+
+    alloc_stats_t *stats = allocator->stats;
+    if (!stats) return;
+
+    dbg_info("%s: %u allocs, %u frees, %u failed, %u bytes live (peak %u)\n",
+            stats->name, stats->allocs, stats->frees, stats->failed,
+            stats->bytes_live, stats->bytes_peak);
+
+    for (u64 i = 0; i < ALLOC_HISTOGRAM_SIZE; i++) {
+
+        if (!stats->histogram[i]) continue;
+
+        if (i == ALLOC_HISTOGRAM_SIZE - 1)
+            dbg_info("%s:   > %u bytes: %u\n", stats->name, 4ull << i, stats->histogram[i]);
+        else
+            dbg_info("%s: <= %u bytes: %u\n", stats->name, 8ull << i, stats->histogram[i]);
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Writes the trace of an allocator to debug (oldest event first).
+///
+/// @param  allocator   The allocator (nothing is written if tracing is disabled).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void alloc_trace_print(allocator_t *allocator) {
+
+    alloc_stats_t *stats = allocator->stats;
+    if (!stats || !stats->trace) return;
+
+    u64 end = stats->trace_next;
+    u64 start = end > ALLOC_TRACE_SIZE ? end - ALLOC_TRACE_SIZE : 0;
+    alloc_event_t *event;
+
+    for (u64 i = start; i < end; i++) {
+
+        event = &stats->trace[i % ALLOC_TRACE_SIZE];
+
+        if (event->size)
+            dbg_info("%s: %u alloc %x (%u bytes) from %x\n",
+                    stats->name, event->tsc, event->vaddr, event->size, event->caller);
+        else
+            dbg_info("%s: %u free  %x from %x\n",
+                    stats->name, event->tsc, event->vaddr, event->caller);
+    }
+}
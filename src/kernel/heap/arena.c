@@ -0,0 +1,261 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Arena Allocator (region based allocation for request-scoped work).
+///
+/// An arena hands out memory by moving a pointer through a chain of chunks. Single blocks are
+/// never freed, instead a position is saved with arena_mark and everything allocated after it
+/// is dropped with arena_rewind (or everything with arena_reset). Chunks stay linked after a
+/// rewind and are reused, arena_trim gives them back to the Physical Memory Manager.
+///
+/// @warning    An arena must not be used from interrupt handlers that could interrupt one of
+///             its allocations.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <types.h>
+#include <paging.h>
+#include <alloc.h>
+#include <arena.h>
+#include <cpu.h>
+#include <pmem.h>
+#include <pmem_shrink.h>
+#include <vmem.h>
+#include <err.h>
+#include <tty.h>
+#include <x86.h>
+
+
+/// @brief  Per-CPU arenas for temporary kernel allocations (see scratch_arena).
+arena_allocator_t scratch_arenas[MAX_CPUS];
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates memory using an Arena Allocator.
+///
+/// @param  self    A pointer to the Arena Allocator Structure.
+/// @param  n_bytes How many bytes to allocate.
+///
+/// @returns    The pointer to the allocated memory (aligned to ARENA_ALIGN).
+///
+/// @warning    Does NOT zero-initialize the memory.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 arena_alloc(arena_allocator_t *self, u64 n_bytes) {
+
+    n_bytes = (n_bytes + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1ull);
+    if (n_bytes > self->allocator.space_left) arena_next_chunk(self, n_bytes);
+
+    u64 vaddr = self->allocator.base_addr + self->top;
+    self->top += n_bytes;
+    self->allocator.space_left -= n_bytes;
+
+    return vaddr;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates aligned memory using an Arena Allocator.
+///
+/// @param  self    A pointer to the Arena Allocator Structure.
+/// @param  n_bytes How many bytes to allocate.
+/// @param  align   The alignment (a power of two).
+///
+/// @returns    The pointer to the allocated memory.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 arena_alloc_aligned(arena_allocator_t *self, u64 n_bytes, u64 align) {
+
+    if (align & (align - 1)) panic("Arena Allocator: unsupported alignment %u\n", align);
+    if (align <= ARENA_ALIGN) return arena_alloc(self, n_bytes);
+
+    // a new chunk with align extra bytes always has room for the padding
+    u64 pad = -(self->allocator.base_addr + self->top) & (align - 1);
+    if (pad + n_bytes > self->allocator.space_left) {
+        arena_next_chunk(self, n_bytes + align);
+        pad = -(self->allocator.base_addr + self->top) & (align - 1);
+    }
+
+    self->top += pad;
+    self->allocator.space_left -= pad;
+    return arena_alloc(self, n_bytes);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Frees memory using an Arena Allocator.
+///
+/// @param  self    The Arena Allocator that was used for allocating.
+/// @param  vaddr   The start address of the memory to free.
+///
+/// Does nothing, the memory is reclaimed by arena_rewind or arena_reset. Only there so an
+/// arena can be passed wherever an allocator_t is expected.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void arena_free(arena_allocator_t *self, u64 vaddr) {
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Initializes an Arena Allocator.
+///
+/// @param  self    The Arena Allocator Structure to fill (chunk_pages is set).
+///
+/// Allocates the first chunk.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void arena_init(arena_allocator_t *self) {
+
+    self->first = (arena_chunk_t*)P2V(pmem_alloc(self->chunk_pages, PMEM_ZONE_ANY));
+    self->first->next = 0;
+    self->first->pages = self->chunk_pages;
+    self->allocator.blocks = self->chunk_pages;
+
+    arena_reset(self);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Saves the current position of an arena.
+///
+/// @param  self    A pointer to the Arena Allocator Structure.
+///
+/// @returns    The position to pass to arena_rewind.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+arena_mark_t arena_mark(arena_allocator_t *self) {
+
+    return (arena_mark_t) { self->cur, self->top };
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Frees everything allocated since a mark was taken.
+///
+/// @param  self    A pointer to the Arena Allocator Structure.
+/// @param  mark    The position returned by arena_mark.
+///
+/// Marks have to be rewound in the reverse order they were taken.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void arena_rewind(arena_allocator_t *self, arena_mark_t mark) {
+
+    arena_select(self, mark.chunk, mark.top);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Frees everything allocated from an arena.
+///
+/// @param  self    A pointer to the Arena Allocator Structure.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void arena_reset(arena_allocator_t *self) {
+
+    arena_select(self, self->first, sizeof(arena_chunk_t));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Gives the chunks behind the current one back to the Physical Memory Manager.
+///
+/// @param  self    A pointer to the Arena Allocator Structure.
+///
+/// @returns    The number of pages freed.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 arena_trim(arena_allocator_t *self) {
+
+    arena_chunk_t *chunk = self->cur->next;
+    arena_chunk_t *next;
+    u64 freed = 0;
+
+    self->cur->next = 0;
+
+    while (chunk) {
+        next = chunk->next;
+        freed += chunk->pages;
+        pmem_free(V2P((u64)chunk), chunk->pages);
+        chunk = next;
+    }
+
+    self->allocator.blocks -= freed;
+    return freed;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Makes a chunk the current chunk of an arena.
+///
+/// @param  self    A pointer to the Arena Allocator Structure.
+/// @param  chunk   The chunk.
+/// @param  top     The offset of the next allocation inside the chunk.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void arena_select(arena_allocator_t *self, arena_chunk_t *chunk, u64 top) {
+
+    self->cur = chunk;
+    self->top = top;
+    self->allocator.base_addr = (u64)chunk;
+    self->allocator.space_left = chunk->pages * PAGE_SIZE - top;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Continues an arena in the next chunk.
+///
+/// @param  self    A pointer to the Arena Allocator Structure.
+/// @param  n_bytes The size of the allocation that did not fit.
+///
+/// Reuses the following chunk if it is big enough, otherwise a new one is inserted.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void arena_next_chunk(arena_allocator_t *self, u64 n_bytes) {
+
+    u64 pages = page_round_up(n_bytes + sizeof(arena_chunk_t));
+    if (pages < self->chunk_pages) pages = self->chunk_pages;
+
+    arena_chunk_t *chunk = self->cur->next;
+
+    if (!chunk || chunk->pages < pages) {
+
+        chunk = (arena_chunk_t*)P2V(pmem_alloc(pages, PMEM_ZONE_ANY));
+        chunk->pages = pages;
+        chunk->next = self->cur->next;
+        self->cur->next = chunk;
+        self->allocator.blocks += pages;
+    }
+
+    arena_select(self, chunk, sizeof(arena_chunk_t));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Initializes the scratch arenas.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void scratch_init(void) {
+
+    tty_puts(WHITE_ON_BLACK, "Setting up scratch arenas...");
+
+    for (u64 i = 0; i < MAX_CPUS; i++) {
+        scratch_arenas[i] = CREATE_ARENA_ALLOCATOR(SCRATCH_CHUNK_PAGES);
+        scratch_arenas[i].allocator.init(&scratch_arenas[i]);
+    }
+
+    pmem_shrinker_register("scratch arenas", scratch_shrink);
+
+    tty_puts(WHITE_ON_BLACK, "Done!\n");
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Frees the unused chunks of the scratch arena of the executing CPU (shrinker).
+///
+/// @param  pages   How many pages should be freed (all unused chunks are freed).
+///
+/// @returns    The number of pages freed.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 scratch_shrink(u64 pages) {
+
+    return arena_trim(scratch_arena());
+}
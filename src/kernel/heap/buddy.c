@@ -12,9 +12,30 @@
 #include <pmem.h>
 #include <vmem.h>
 #include <tty.h>
-#include <math.h>
 #include <err.h>
 #include <x86.h>
+#include <dbg.h>
+
+
+#define BUDDY_LAYER_SIZE(layer)     (GREATEST >> (layer))
+#define BUDDY_LAYER_OFFSET(layer)   ((1 << (layer)) - 1)
+
+/// @brief  The block size of every layer.
+const u16 buddy_layer_sizes[LAYERS] = {
+    BUDDY_LAYER_SIZE(0), BUDDY_LAYER_SIZE(1), BUDDY_LAYER_SIZE(2), BUDDY_LAYER_SIZE(3),
+    BUDDY_LAYER_SIZE(4), BUDDY_LAYER_SIZE(5), BUDDY_LAYER_SIZE(6), BUDDY_LAYER_SIZE(7),
+    BUDDY_LAYER_SIZE(8), BUDDY_LAYER_SIZE(9)
+};
+
+/// @brief  The bit offset of every layer from the start of the bitmap.
+const u16 buddy_layer_offsets[LAYERS] = {
+    BUDDY_LAYER_OFFSET(0), BUDDY_LAYER_OFFSET(1), BUDDY_LAYER_OFFSET(2), BUDDY_LAYER_OFFSET(3),
+    BUDDY_LAYER_OFFSET(4), BUDDY_LAYER_OFFSET(5), BUDDY_LAYER_OFFSET(6), BUDDY_LAYER_OFFSET(7),
+    BUDDY_LAYER_OFFSET(8), BUDDY_LAYER_OFFSET(9)
+};
+
+_Static_assert(LAYERS == 10, "the layer tables have to be extended");
+_Static_assert(GREATEST == 1 << GREATEST_SHIFT, "GREATEST_SHIFT does not match GREATEST");
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -24,57 +45,128 @@
 /// @param  n_bytes How many bytes to allocate.
 /// 
 /// @returns    The pointer to the allocated memory.
+///
+/// @warning    Does NOT zero-initialize the memory (see buddy_zalloc).
+///
+/// Takes the smallest free block that fits from the free lists and splits it down to the
+/// requested layer, the right halves stay free. O(LAYERS) regardless of the heap size.
+/// A growable heap maps a new page if no block fits.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 u64 buddy_alloc(buddy_allocator_t *self, u64 n_bytes) {
 
-    u8 *bitmap;
-    u64 layer;
-    u64 layer_off;
-    u64 layer_size;
-    bool buddy1;
-    bool buddy2;
-
     u64 best_layer = buddy_layer_from_size(n_bytes);
     if (best_layer == 0) 
         panic("Buddy Allocator: requested allocation size exceeds half page limit\n");
 
-    for (u64 page = 0; page < self->allocator.blocks; page++) {
-    
-        bitmap = (u8*)self->allocator.base_addr + page * PAGE_SIZE;
-        layer = best_layer;
-
-        for (; layer > 0; layer--) {
-        
-            layer_off = buddy_bit_offset_layer(layer);
-            layer_size = buddy_bits_in_layer(layer);
-
-            for (u64 off = layer_off; off < layer_off + layer_size; off += 2) {
-                // check for a pair with different values
-                buddy1 = buddy_bitmap_get_bit(bitmap, off);
-                buddy2 = buddy_bitmap_get_bit(bitmap, off + 1);
-                if (!(buddy1 ^ buddy2)) continue;
-
-                // if true mark the unused buddy as used
-                off += buddy1;
-                buddy_bitmap_mark_bit(bitmap, off, true);
-                off -= layer_off;
-
-                // check if we are on the correct layer
-                // loop through all layers and mark the correct blocks as used
-                while (layer != best_layer) {
-                    layer++;
-                    off *= 2;
-                    buddy_bitmap_mark_bit(bitmap, buddy_bit_offset_layer(layer) + off, true);
-                }
-
-                // calculate and return start address
-                return self->allocator.base_addr + off * buddy_layer_block_size(layer);
-            }
-        }
+    // the highest (= smallest block size) non-empty layer up to best_layer
+    u64 fitting = self->free_mask & ((2ull << best_layer) - 1);
+    if (!fitting) {
+        // a new page has free blocks of every layer up to half a page
+        buddy_grow(self);
+        fitting = self->free_mask & ((2ull << best_layer) - 1);
+    }
+    u64 layer = 63 - __builtin_clzll(fitting);
+
+    u64 vaddr = self->allocator.base_addr + self->free_lists[layer];
+    buddy_list_remove(self, vaddr, layer);
+
+    u8 *bitmap = (u8*)(vaddr & ~(PAGE_SIZE - 1));
+    u64 off = (vaddr % PAGE_SIZE) / buddy_layer_block_size(layer);
+    buddy_bitmap_mark_bit(bitmap, buddy_bit_offset_layer(layer) + off, true);
+
+    // split until the block has the requested size
+    while (layer != best_layer) {
+        layer++;
+        off *= 2;
+        buddy_bitmap_mark_bit(bitmap, buddy_bit_offset_layer(layer) + off, true);
+        buddy_list_push(self, vaddr + buddy_layer_block_size(layer), layer);
     }
 
-    panic("Buddy Allocator: out of memory\n");
+    return vaddr;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates aligned heap memory using a Buddy Allocator.
+///
+/// @param  self    A pointer to the Buddy Allocator Structure.
+/// @param  n_bytes How many bytes to allocate.
+/// @param  align   The alignment (a power of two up to half a page).
+///
+/// @returns    The pointer to the allocated memory.
+///
+/// Blocks are aligned to their size, so a block of at least align bytes is taken.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 buddy_alloc_aligned(buddy_allocator_t *self, u64 n_bytes, u64 align) {
+
+    if ((align & (align - 1)) || align > GREATEST / 2)
+        panic("Buddy Allocator: unsupported alignment %u\n", align);
+
+    return buddy_alloc(self, n_bytes > align ? n_bytes : align);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates zero-initialized heap memory using a Buddy Allocator.
+///
+/// @param  self    A pointer to the Buddy Allocator Structure.
+/// @param  n_bytes How many bytes to allocate (and zero).
+///
+/// @returns    The pointer to the allocated memory.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 buddy_zalloc(buddy_allocator_t *self, u64 n_bytes) {
+
+    u64 vaddr = buddy_alloc(self, n_bytes);
+    mem_set((u8*)vaddr, 0, n_bytes);
+    return vaddr;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Pushes a free block onto the free list of its layer.
+///
+/// @param  self    A pointer to the Buddy Allocator Structure.
+/// @param  vaddr   The start address of the free block.
+/// @param  layer   The layer of the free block.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void buddy_list_push(buddy_allocator_t *self, u64 vaddr, u64 layer) {
+
+    buddy_link_t *link = (buddy_link_t*)vaddr;
+    u32 off = vaddr - self->allocator.base_addr;
+
+    link->next = self->free_lists[layer];
+    link->prev = 0;
+
+    if (link->next) 
+        ((buddy_link_t*)(self->allocator.base_addr + link->next))->prev = off;
+
+    self->free_lists[layer] = off;
+    self->free_mask |= 1ull << layer;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Removes a free block from the free list of its layer.
+///
+/// @param  self    A pointer to the Buddy Allocator Structure.
+/// @param  vaddr   The start address of the free block.
+/// @param  layer   The layer of the free block.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void buddy_list_remove(buddy_allocator_t *self, u64 vaddr, u64 layer) {
+
+    buddy_link_t *link = (buddy_link_t*)vaddr;
+
+    if (link->prev) ((buddy_link_t*)(self->allocator.base_addr + link->prev))->next = link->next;
+    else self->free_lists[layer] = link->next;
+
+    if (link->next) ((buddy_link_t*)(self->allocator.base_addr + link->next))->prev = link->prev;
+
+    if (!self->free_lists[layer]) self->free_mask &= ~(1ull << layer);
 }
 
 
@@ -84,62 +176,161 @@ u64 buddy_alloc(buddy_allocator_t *self, u64 n_bytes) {
 /// @param  n_bytes     The allocation size.
 ///
 /// @returns    The optimal layer number for the given allocation size.
+///
+/// The block size is the next power of two (at least SMALLEST), so the layer follows from the
+/// position of the highest bit of n_bytes - 1. 0 is treated like 1.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 u64 buddy_layer_from_size(u64 n_bytes) {
 
     if (n_bytes > GREATEST / 2) 
         panic("Buddy Allocator: requested allocation size exceeds half page limit\n");
-    
-    u64 layer;
-    if (n_bytes <= SMALLEST) layer = LAYERS - 1;
-    else {
-        u64 size = GREATEST;
-        for (layer = 0; layer < LAYERS; layer++) {
-            if (size / n_bytes == 1) break;
-            size /= 2;
-        }
+
+    u64 bits = (n_bytes - (n_bytes != 0)) | (SMALLEST - 1);
+    return __builtin_clzll(bits) - (64 - GREATEST_SHIFT);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Initializes a Buddy Allocator.
+///
+/// @param  self    The empty Buddy Allocator Structure to fill.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void buddy_init(buddy_allocator_t *self) {
+
+    for (u64 layer = 0; layer < LAYERS; layer++) self->free_lists[layer] = 0;
+    self->free_mask = 0;
+
+    for (u64 i = 0; i < self->allocator.blocks; i++) {
+        buddy_init_page(self, self->allocator.base_addr + i * PAGE_SIZE);
     }
-    return layer;
 }
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-/// @brief  Calculates the size of the blocks in a layer.
+/// @brief  Returns the usable size of a block of a Buddy Allocator.
 ///
-/// @param  layer   The layer.
+/// @param  self    A pointer to the Buddy Allocator Structure.
+/// @param  vaddr   The start address of the allocated block.
 ///
-/// @returns    The blocksize of the layer.
+/// @returns    The size of the block in bytes.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-u64 buddy_layer_block_size(u64 layer) {
+u64 buddy_size(buddy_allocator_t *self, u64 vaddr) {
 
-    u64 size = GREATEST;
-    for (u64 i = 0; i < layer; i++) {
-        size /= 2;
+    return buddy_layer_block_size(buddy_block_layer(vaddr));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Adds a page to the free lists of a Buddy Allocator.
+///
+/// @param  self    A pointer to the Buddy Allocator Structure.
+/// @param  vaddr   The start address of the page (only the bitmap gets initialized).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void buddy_init_page(buddy_allocator_t *self, u64 vaddr) {
+
+    u8 *bitmap = (u8*)vaddr;
+    mem_set(bitmap, 0, BUDDY_BITMAP_SIZE);
+
+    // allocate some space at the beginning of the page for the bitmap
+    for (u64 layer = 0; layer <= 5; layer++) {
+        buddy_bitmap_mark_bit(bitmap, buddy_bit_offset_layer(layer), true);
+    }
+
+    // the buddies of the bitmap path are free
+    for (u64 layer = 1; layer <= 5; layer++) {
+        buddy_list_push(self, vaddr + buddy_layer_block_size(layer), layer);
     }
-    return size;
 }
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-/// @brief  Initializes a Buddy Allocator.
+/// @brief  Maps a new page at the end of a growable Buddy Allocator.
 ///
-/// @param  self    The empty Buddy Allocator Structure to fill.
+/// @param  self    A pointer to the Buddy Allocator Structure.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-void buddy_init(buddy_allocator_t *self) {
+void buddy_grow(buddy_allocator_t *self) {
 
-    u8 *bitmap;
+    if (self->allocator.blocks >= self->max_blocks) panic("Buddy Allocator: out of memory\n");
 
-    // allocate some space at the beginning of every page for bitmaps
-    for (u64 i = 0; i < self->allocator.blocks; i++) {
+    u64 vaddr = self->allocator.base_addr + self->allocator.blocks * PAGE_SIZE;
+    vmem_map(
+            kernel_pt4, 
+            vaddr, 
+            pmem_alloc(1, PMEM_ZONE_ANY),
+            PAGE_WRITE | PAGE_GLOBAL);
+
+    self->allocator.blocks++;
+    self->allocator.space_left += PAGE_SIZE;
+    if (self->allocator.blocks > self->high_water) self->high_water = self->allocator.blocks;
+    self->grows++;
+
+    buddy_init_page(self, vaddr);
+}
 
-        bitmap = (u8*)self->allocator.base_addr + i * PAGE_SIZE;
-        for (u64 layer = 0; layer <= 5; layer++) {
-            buddy_bitmap_mark_bit(bitmap, buddy_bit_offset_layer(layer), true);
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Hands the empty pages at the end of a growable Buddy Allocator back.
+///
+/// @param  self    A pointer to the Buddy Allocator Structure.
+///
+/// @returns    The number of pages freed.
+///
+/// Meant to be called under memory pressure, a fixed size heap is never shrunk.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 buddy_shrink(buddy_allocator_t *self) {
+
+    u64 vaddr;
+    u64 paddr;
+    u64 freed = 0;
+
+    if (!self->max_blocks) return 0;
+
+    while (self->allocator.blocks > 0) {
+
+        vaddr = self->allocator.base_addr + (self->allocator.blocks - 1) * PAGE_SIZE;
+
+        // a page is empty if all buddies of the bitmap path are free (merged)
+        for (u64 layer = 1; layer <= 5; layer++) {
+            if (buddy_bitmap_get_bit((u8*)vaddr, buddy_bit_offset_layer(layer) + 1)) 
+                goto done;
+        }
+
+        for (u64 layer = 1; layer <= 5; layer++) {
+            buddy_list_remove(self, vaddr + buddy_layer_block_size(layer), layer);
         }
+
+        paddr = vmem_translate(kernel_pt4, vaddr);
+        vmem_unmap(kernel_pt4, vaddr);
+        pmem_free(paddr, 1);
+
+        self->allocator.blocks--;
+        self->allocator.space_left -= PAGE_SIZE;
+        freed++;
     }
+
+done:
+    if (freed) self->shrinks++;
+    return freed;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Writes the size statistics of a Buddy Allocator to debug.
+///
+/// @param  self    A pointer to the Buddy Allocator Structure.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void buddy_print_stats(buddy_allocator_t *self) {
+
+    dbg_info("heap: %u pages (high-water %u, max %u), %u grows, %u shrinks\n",
+            self->allocator.blocks, self->high_water, self->max_blocks, 
+            self->grows, self->shrinks);
 }
 
 
@@ -209,88 +400,64 @@ bool buddy_bitmap_get_bit(u8 *bitmap, u64 bit) {
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-/// @brief  Calculates a layer's bit offset from the start of the Buddy Allocator bitmap.
+/// @brief  Frees previously allocated memory using a Buddy Allocator.
 ///
-/// @param  layer   The layer.
+/// @param  self    The Buddy Allocator that was used for allocating.
+/// @param  vaddr   The start address of the memory to free.
 ///
-/// @returns    The bit offset of the layer from the start of the bitmap.
+/// Merges the block with its free buddies and puts the result onto the free lists. Only the
+/// bitmap and the links are written, the block is filled with BUDDY_POISON_BYTE when compiled
+/// with -DBUDDY_POISON.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-u64 buddy_bit_offset_layer(u64 layer) {
+void buddy_free(buddy_allocator_t *self, u64 vaddr) {
 
-    return math_pow(2, layer) - 1;
-}
+    u8 *bitmap = (u8*)(vaddr & ~(PAGE_SIZE - 1));
+    u64 layer = buddy_block_layer(vaddr);
+    u64 off = (vaddr % PAGE_SIZE) / buddy_layer_block_size(layer);
 
+#ifdef BUDDY_POISON
+    mem_set((u8*)vaddr, BUDDY_POISON_BYTE, buddy_layer_block_size(layer));
+#endif
 
-///////////////////////////////////////////////////////////////////////////////////////////////////
-/// @brief  Calculates the size of a layer in the Buddy Allocator bitmap in bits.
-///
-/// @param  layer   The layer.
-///
-/// @returns    The amount of bits associated with that layer.
-///////////////////////////////////////////////////////////////////////////////////////////////////
+    // merge with the buddy as long as it is free (the bitmap path of layer 1 never is)
+    while (true) {
 
-u64 buddy_bits_in_layer(u64 layer) {
+        buddy_bitmap_mark_bit(bitmap, buddy_bit_offset_layer(layer) + off, false);
+        if (buddy_bitmap_get_bit(bitmap, buddy_bit_offset_layer(layer) + (off ^ 1))) break;
+
+        buddy_list_remove(self, (u64)bitmap + (off ^ 1) * buddy_layer_block_size(layer), layer);
+        off /= 2;
+        layer--;
+    }
 
-    return math_pow(2, layer);
+    buddy_list_push(self, (u64)bitmap + off * buddy_layer_block_size(layer), layer);
 }
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-/// @brief  Frees previously allocated memory using a Buddy Allocator.
+/// @brief  Determines the layer of an allocated block.
 ///
-/// @param  self    The Buddy Allocator that was used for allocating.
-/// @param  vaddr   The start address of the memory to free.
+/// @param  vaddr   The start address of the block.
+///
+/// @returns    The layer of the block.
+///
+/// The allocated block is the smallest one starting at vaddr with its bit set (the bits below
+/// an allocated block are always clear).
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-void buddy_free(buddy_allocator_t *self, u64 vaddr) {
-
-    u64 off;
-    bool block;
+u64 buddy_block_layer(u64 vaddr) {
 
-    u64 off_from_base = vaddr - self->allocator.base_addr;
-    u64 page_num = off_from_base / PAGE_SIZE;
-    u8 *bitmap = (u8*)self->allocator.base_addr + page_num * PAGE_SIZE;
-    off_from_base %= PAGE_SIZE;
+    u8 *bitmap = (u8*)(vaddr & ~(PAGE_SIZE - 1));
+    u64 off_in_page = vaddr % PAGE_SIZE;
 
     for (
             u64 layer = LAYERS - 1; 
-            (off_from_base % buddy_layer_block_size(layer) == 0) && (layer > 0); 
+            (off_in_page % buddy_layer_block_size(layer) == 0) && (layer > 0); 
             layer--) {
 
-        off = off_from_base / buddy_layer_block_size(layer);
-        block = buddy_bitmap_get_bit(bitmap, buddy_bit_offset_layer(layer) + off);
-
-        if (!block) continue;
-
-        u64 size = buddy_layer_block_size(layer);
-        mem_set((u8*)vaddr, 0, size);
-
-        buddy_bitmap_mark_bit(bitmap, buddy_bit_offset_layer(layer) + off, false);
-
-        if (off % 2 == 1) off--;
-        else off++;
-        
-        block = buddy_bitmap_get_bit(bitmap, buddy_bit_offset_layer(layer) + off);
-
-        if (block) return;
-        while (layer != 0) {
-        
-            off /= 2;
-            layer--;
-
-            buddy_bitmap_mark_bit(bitmap, buddy_bit_offset_layer(layer) + off, false);
-
-            if (off % 2 == 1) off--;
-            else off++;
-
-            block = buddy_bitmap_get_bit(bitmap, buddy_bit_offset_layer(layer) + off);
-
-            if (block) return;
-            
-        }
-        break;
-
+        u64 off = off_in_page / buddy_layer_block_size(layer);
+        if (buddy_bitmap_get_bit(bitmap, buddy_bit_offset_layer(layer) + off)) return layer;
     }
 
     panic("Buddy Allocator: there is no block used\n");
@@ -9,7 +9,9 @@
 #include <bump.h>
 #include <pmem.h>
 #include <vmem.h>
+#include <err.h>
 #include <tty.h>
+#include <x86.h>
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -29,6 +31,26 @@ u64 bump_alloc(bump_allocator_t *self, u64 n_bytes) {
 }
 
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates aligned heap memory using a Bump Allocator.
+///
+/// @param  self    A pointer to the Bump Allocator Structure.
+/// @param  n_bytes How many bytes to allocate.
+/// @param  align   The alignment (a power of two).
+///
+/// @returns    The pointer to the allocated memory.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 bump_alloc_aligned(bump_allocator_t *self, u64 n_bytes, u64 align) {
+
+    if (align & (align - 1)) panic("Bump Allocator: unsupported alignment %u\n", align);
+
+    // skip the padding in front of the aligned address
+    self->top += -(self->allocator.base_addr + self->top) & (align - 1);
+    return bump_alloc(self, n_bytes);
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 /// @brief  Frees previously allocated memory using a Bump Allocator.
 ///
@@ -0,0 +1,494 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  General purpose kernel heap.
+///
+/// The virtual range of the heap is split in two halves. Allocations up to KMALLOC_SMALL_MAX
+/// are served by a growable buddy heap in the first half. Larger ones get a run of whole pages
+/// in the second half: the run is contiguous in virtual memory only, every page is backed by a
+/// frame of its own, so big buffers neither need nor fragment contiguous physical memory.
+///
+/// Every CPU keeps bins of free small blocks per size. Allocating and freeing only touch the
+/// local bins (with interrupts disabled), the shared heap is locked once per batch.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <types.h>
+#include <paging.h>
+#include <alloc.h>
+#include <buddy.h>
+#include <kmalloc.h>
+#include <pmem.h>
+#include <vmem.h>
+#include <tty.h>
+#include <err.h>
+#include <x86.h>
+#include <utils.h>
+#include <spinlock.h>
+#include <pmem_shrink.h>
+#include <dbg.h>
+
+
+#define KMALLOC_BIT(map, page)          (((map)[(page) / 64] >> ((page) % 64)) & 1)
+#define KMALLOC_SET_BIT(map, page)      ((map)[(page) / 64] |= 1ull << ((page) % 64))
+#define KMALLOC_CLEAR_BIT(map, page)    ((map)[(page) / 64] &= ~(1ull << ((page) % 64)))
+
+
+/// @brief  The general purpose heap of the kernel.
+kmalloc_allocator_t kernel_heap;
+/// @brief  Statistics of the kernel heap (only used when built with -DALLOC_STATS).
+alloc_stats_t kernel_heap_stats;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates memory using a Kmalloc Allocator.
+///
+/// @param  self    A pointer to the Kmalloc Allocator Structure.
+/// @param  n_bytes How many bytes to allocate.
+///
+/// @returns    The pointer to the allocated memory (page aligned above KMALLOC_SMALL_MAX).
+///
+/// @warning    Does NOT zero-initialize allocations up to KMALLOC_SMALL_MAX (see kmalloc_zalloc).
+///
+/// Small allocations are taken from the bin of the executing CPU, which only goes to the shared
+/// heap (and takes the lock) when it is empty.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 kmalloc_alloc(kmalloc_allocator_t *self, u64 n_bytes) {
+
+    u64 vaddr;
+    u64 rflags = x86_irq_save();
+
+    if (n_bytes > KMALLOC_SMALL_MAX) {
+
+        spin_lock(&self->lock);
+        vaddr = kmalloc_alloc_pages(self, page_round_up(n_bytes));
+        spin_unlock(&self->lock);
+
+        x86_irq_restore(rflags);
+        return vaddr;
+    }
+
+    u64 layer = buddy_layer_from_size(n_bytes);
+    kmalloc_cpu_t *cpu = &self->cpus[cpu_id()];
+    kmalloc_bin_t *bin = &cpu->bins[layer];
+
+    if (bin->count == 0) {
+        cpu->misses++;
+        kmalloc_refill(self, bin, layer);
+        cpu->refills++;
+    } else {
+        cpu->hits++;
+    }
+
+    vaddr = bin->blocks[--bin->count];
+
+    x86_irq_restore(rflags);
+    return vaddr;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates aligned memory using a Kmalloc Allocator.
+///
+/// @param  self    A pointer to the Kmalloc Allocator Structure.
+/// @param  n_bytes How many bytes to allocate.
+/// @param  align   The alignment (a power of two up to a page).
+///
+/// @returns    The pointer to the allocated memory.
+///
+/// Buddy blocks are aligned to their size and page runs to a page, so asking for at least
+/// align bytes is enough.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 kmalloc_alloc_aligned(kmalloc_allocator_t *self, u64 n_bytes, u64 align) {
+
+    if ((align & (align - 1)) || align > PAGE_SIZE)
+        panic("Kmalloc: unsupported alignment %u\n", align);
+
+    return kmalloc_alloc(self, n_bytes > align ? n_bytes : align);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates zero-initialized memory using a Kmalloc Allocator.
+///
+/// @param  self    A pointer to the Kmalloc Allocator Structure.
+/// @param  n_bytes How many bytes to allocate.
+///
+/// @returns    The pointer to the allocated memory.
+///
+/// Page runs are built from zeroed frames anyway, only small allocations are cleared.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 kmalloc_zalloc(kmalloc_allocator_t *self, u64 n_bytes) {
+
+    u64 vaddr = self->allocator.alloc(self, n_bytes);
+    if (n_bytes <= KMALLOC_SMALL_MAX) mem_set((u8*)vaddr, 0, n_bytes);
+    return vaddr;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Frees memory using a Kmalloc Allocator.
+///
+/// @param  self    The Kmalloc Allocator that was used for allocating.
+/// @param  vaddr   The start address of the memory to free.
+///
+/// Small blocks go to the bin of the executing CPU (whichever CPU allocated them), a full bin
+/// gives its oldest half back to the shared heap.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void kmalloc_free(kmalloc_allocator_t *self, u64 vaddr) {
+
+    u64 rflags = x86_irq_save();
+
+    if (vaddr >= self->large_base) {
+
+        spin_lock(&self->lock);
+        kmalloc_free_pages(self, vaddr);
+        spin_unlock(&self->lock);
+
+        x86_irq_restore(rflags);
+        return;
+    }
+
+    // cached blocks stay allocated in the bitmap, so the layer can be read without the lock
+    kmalloc_cpu_t *cpu = &self->cpus[cpu_id()];
+    kmalloc_bin_t *bin = &cpu->bins[buddy_block_layer(vaddr)];
+
+    if (bin->count == KMALLOC_BIN_SIZE) {
+        kmalloc_flush(self, bin, KMALLOC_BIN_BATCH);
+        cpu->flushes++;
+    }
+
+    bin->blocks[bin->count++] = vaddr;
+
+    x86_irq_restore(rflags);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Initializes a Kmalloc Allocator.
+///
+/// @param  self    The Kmalloc Allocator Structure to fill (base_addr and blocks are set).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void kmalloc_init(kmalloc_allocator_t *self) {
+
+    u64 half = self->allocator.blocks / 2;
+
+    self->small = CREATE_GROWABLE_BUDDY_ALLOCATOR(self->allocator.base_addr, half);
+    self->small.allocator.init(&self->small);
+
+    self->large_base = self->allocator.base_addr + half * PAGE_SIZE;
+    self->large_pages = self->allocator.blocks - half;
+    self->large_next = 0;
+    self->large_mapped = 0;
+    self->large_high_water = 0;
+    self->large_runs = 0;
+
+    u64 map_pages = page_round_up((self->large_pages + 63) / 64 * sizeof(u64));
+    self->large_used = (u64*)P2V(pmem_alloc_clean(map_pages, PMEM_ZONE_ANY));
+    self->large_heads = (u64*)P2V(pmem_alloc_clean(map_pages, PMEM_ZONE_ANY));
+
+    // empty bins and zeroed statistics
+    self->lock = 0;
+    self->cpus = (kmalloc_cpu_t*)P2V(pmem_alloc_clean(
+                page_round_up(MAX_CPUS * sizeof(kmalloc_cpu_t)), PMEM_ZONE_ANY));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns the usable size of an allocation of a Kmalloc Allocator.
+///
+/// @param  self    A pointer to the Kmalloc Allocator Structure.
+/// @param  vaddr   The start address of the allocation.
+///
+/// @returns    The size of the buddy block or of the page run in bytes.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 kmalloc_size(kmalloc_allocator_t *self, u64 vaddr) {
+
+    if (vaddr < self->large_base) return buddy_size(&self->small, vaddr);
+
+    u64 first = (vaddr - self->large_base) / PAGE_SIZE;
+    u64 page = first + 1;
+
+    while (
+            page < self->large_pages &&
+            KMALLOC_BIT(self->large_used, page) &&
+            !KMALLOC_BIT(self->large_heads, page))
+        page++;
+
+    return (page - first) * PAGE_SIZE;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Refills an empty bin with a batch of blocks from the shared heap.
+///
+/// @param  self    A pointer to the Kmalloc Allocator Structure.
+/// @param  bin     The bin to refill.
+/// @param  layer   The layer of the bin.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void kmalloc_refill(kmalloc_allocator_t *self, kmalloc_bin_t *bin, u64 layer) {
+
+    u64 size = buddy_layer_block_size(layer);
+
+    spin_lock(&self->lock);
+
+    // push in reverse so the blocks are handed out in ascending order
+    for (u64 i = KMALLOC_BIN_BATCH; i > 0; i--)
+        bin->blocks[i - 1] = buddy_alloc(&self->small, size);
+    bin->count = KMALLOC_BIN_BATCH;
+
+    spin_unlock(&self->lock);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns blocks from a bin to the shared heap.
+///
+/// @param  self    A pointer to the Kmalloc Allocator Structure.
+/// @param  bin     The bin to flush.
+/// @param  count   How many blocks to return (the oldest ones first).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void kmalloc_flush(kmalloc_allocator_t *self, kmalloc_bin_t *bin, u64 count) {
+
+    if (count > bin->count) count = bin->count;
+
+    spin_lock(&self->lock);
+    for (u64 i = 0; i < count; i++) buddy_free(&self->small, bin->blocks[i]);
+    spin_unlock(&self->lock);
+
+    for (u64 i = count; i < bin->count; i++) bin->blocks[i - count] = bin->blocks[i];
+    bin->count -= count;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Hands unused memory of a Kmalloc Allocator back to the Physical Memory Manager.
+///
+/// @param  self    A pointer to the Kmalloc Allocator Structure.
+///
+/// @returns    The number of pages freed.
+///
+/// Flushes the bins of the executing CPU and shrinks the shared heap.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 kmalloc_shrink(kmalloc_allocator_t *self) {
+
+    u64 rflags = x86_irq_save();
+    kmalloc_cpu_t *cpu = &self->cpus[cpu_id()];
+
+    for (u64 layer = 1; layer < LAYERS; layer++)
+        kmalloc_flush(self, &cpu->bins[layer], KMALLOC_BIN_SIZE);
+
+    spin_lock(&self->lock);
+    u64 freed = buddy_shrink(&self->small);
+    spin_unlock(&self->lock);
+
+    x86_irq_restore(rflags);
+    return freed;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates and maps a run of zero-initialized pages.
+///
+/// @param  self    A pointer to the Kmalloc Allocator Structure.
+/// @param  pages   The size of the run in pages.
+///
+/// @returns    The virtual address of the run.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 kmalloc_alloc_pages(kmalloc_allocator_t *self, u64 pages) {
+
+    u64 first = kmalloc_find_run(self, pages);
+    if (first == (u64)-1) panic("Kmalloc: no virtual memory left for %u pages\n", pages);
+
+    u64 vaddr = self->large_base + first * PAGE_SIZE;
+
+    KMALLOC_SET_BIT(self->large_heads, first);
+    for (u64 page = 0; page < pages; page++) {
+
+        KMALLOC_SET_BIT(self->large_used, first + page);
+        vmem_map(
+                kernel_pt4,
+                vaddr + page * PAGE_SIZE,
+                pmem_alloc_clean(1, PMEM_ZONE_ANY),
+                PAGE_WRITE | PAGE_GLOBAL);
+    }
+
+    self->large_next = first + pages;
+    self->large_mapped += pages;
+    if (self->large_mapped > self->large_high_water) self->large_high_water = self->large_mapped;
+    self->large_runs++;
+
+    return vaddr;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Unmaps a run of pages and gives the frames back to the Physical Memory Manager.
+///
+/// @param  self    The Kmalloc Allocator that was used for allocating.
+/// @param  vaddr   The start address of the run.
+///
+/// The run ends at the first unused page or at the head of the next run.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void kmalloc_free_pages(kmalloc_allocator_t *self, u64 vaddr) {
+
+    u64 batch[KMALLOC_FREE_BATCH];
+    u64 count = 0;
+    u64 first = (vaddr - self->large_base) / PAGE_SIZE;
+    u64 page = first;
+
+    if (vaddr % PAGE_SIZE || first >= self->large_pages ||
+            !KMALLOC_BIT(self->large_heads, first))
+        panic("Kmalloc: %x is not the start of a page run\n", vaddr);
+
+    KMALLOC_CLEAR_BIT(self->large_heads, first);
+
+    do {
+        KMALLOC_CLEAR_BIT(self->large_used, page);
+        batch[count++] = vmem_translate(kernel_pt4, self->large_base + page * PAGE_SIZE);
+        page++;
+
+        if (count == KMALLOC_FREE_BATCH) {
+            kmalloc_release_pages(self, page - count, batch, count);
+            count = 0;
+        }
+    } while (
+            page < self->large_pages &&
+            KMALLOC_BIT(self->large_used, page) &&
+            !KMALLOC_BIT(self->large_heads, page));
+
+    if (count) kmalloc_release_pages(self, page - count, batch, count);
+
+    self->large_mapped -= page - first;
+    self->large_runs--;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Unmaps pages of a run and gives their frames back to the Physical Memory Manager.
+///
+/// @param  self    A pointer to the Kmalloc Allocator Structure.
+/// @param  page    The index of the first page.
+/// @param  frames  The physical addresses of the pages.
+/// @param  count   The number of pages.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void kmalloc_release_pages(kmalloc_allocator_t *self, u64 page, u64 *frames, u64 count) {
+
+    // the TLB entries are invalidated at once, before the frames can be reused
+    vmem_unmap_region(kernel_pt4, self->large_base + page * PAGE_SIZE, count);
+    pmem_free_batch(frames, count);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Searches for a run of unused pages (next fit).
+///
+/// @param  self    A pointer to the Kmalloc Allocator Structure.
+/// @param  pages   The size of the run in pages.
+///
+/// @returns    The index of the first page of the run or -1 if there is none.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 kmalloc_find_run(kmalloc_allocator_t *self, u64 pages) {
+
+    u64 run = 0;
+    u64 page = self->large_next;
+
+    for (u64 i = 0; i < self->large_pages + pages; i++, page++) {
+
+        // runs do not wrap around
+        if (page >= self->large_pages) {
+            page = 0;
+            run = 0;
+        }
+
+        if (KMALLOC_BIT(self->large_used, page)) {
+            run = 0;
+            continue;
+        }
+
+        if (++run == pages) return page + 1 - pages;
+    }
+
+    return -1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Writes the statistics of a Kmalloc Allocator to debug.
+///
+/// @param  self    A pointer to the Kmalloc Allocator Structure.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void kmalloc_print_stats(kmalloc_allocator_t *self) {
+
+    kmalloc_cpu_t *cpu;
+    u64 total;
+
+    buddy_print_stats(&self->small);
+    dbg_info("kmalloc: %u pages in %u runs (high-water %u, max %u)\n",
+            self->large_mapped, self->large_runs, self->large_high_water, self->large_pages);
+
+    for (u64 i = 0; i < MAX_CPUS; i++) {
+
+        cpu = &self->cpus[i];
+        total = cpu->hits + cpu->misses;
+        if (total == 0) continue;
+
+        dbg_info("kmalloc cpu %u: hit rate %u%% (%u/%u), %u refills, %u flushes\n",
+                i, cpu->hits * 100 / total, cpu->hits, total, cpu->refills, cpu->flushes);
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Sets up the kernel heap in the virtual range reserved by vmem_init.
+///
+/// @warning    Has to be called after vmem_init.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void kernel_heap_init(void) {
+
+    tty_puts(WHITE_ON_BLACK, "Setting up kernel heap...");
+
+    kernel_heap = CREATE_KMALLOC_ALLOCATOR(kernel_heap_base, KERNEL_HEAP_SIZE);
+    kernel_heap.allocator.init(&kernel_heap);
+
+#if defined(ALLOC_STATS) || defined(ALLOC_TRACE)
+    alloc_stats_enable(&kernel_heap.allocator, &kernel_heap_stats, "kernel heap");
+#endif
+
+    pmem_shrinker_register("kernel heap", kernel_heap_shrink);
+
+    tty_puts(WHITE_ON_BLACK, "Done!\n");
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Gives unused pages of the kernel heap back (shrinker).
+///
+/// @param  pages   How many pages should be freed (the heap frees what it can).
+///
+/// @returns    The number of pages freed.
+///
+/// Skipped if the heap is locked, the allocation that ran out of memory may come from the
+/// heap itself.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 kernel_heap_shrink(u64 pages) {
+
+    if (!spin_trylock(&kernel_heap.lock)) return 0;
+    spin_unlock(&kernel_heap.lock);
+
+    return kmalloc_shrink(&kernel_heap);
+}
@@ -0,0 +1,224 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Slab Allocator (object cache for fixed-size kernel objects).
+///
+/// Every slab is a single page holding a header and as many objects as fit. Each object is
+/// followed by the link of the free list, so constructed objects are never overwritten (caches
+/// without a constructor keep the link in the last word of the free object instead).
+/// A CPU allocates from and frees to its own free list without any synchronisation. Objects
+/// freed by another CPU are pushed onto the owner's remote stack with a compare-and-swap, the
+/// owner takes the whole stack at once when its free list runs empty (so there is no ABA issue).
+///
+/// @warning    Must not be used from interrupt handlers (the local free list is not protected).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <types.h>
+#include <paging.h>
+#include <alloc.h>
+#include <slab.h>
+#include <cpu.h>
+#include <pmem.h>
+#include <vmem.h>
+#include <err.h>
+#include <tty.h>
+#include <x86.h>
+#include <dbg.h>
+
+
+/// @brief  The free list link of an object.
+#define SLAB_LINK(self, obj)    (*(u64*)((obj) + (self)->stride - sizeof(u64)))
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates an object using a Slab Allocator.
+///
+/// @param  self    A pointer to the Slab Allocator Structure.
+/// @param  n_bytes How many bytes to allocate (at most the object size).
+///
+/// @returns    The pointer to the allocated object (in constructed state).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 slab_alloc(slab_allocator_t *self, u64 n_bytes) {
+
+    if (n_bytes > self->obj_size)
+        panic("Slab Allocator: %u bytes requested from the %s cache\n", n_bytes, self->name);
+
+    slab_cpu_t *cpu = &self->cpus[cpu_id()];
+
+    // take over the objects other CPUs have freed, then get a new slab
+    if (!cpu->free) cpu->free = __atomic_exchange_n(&cpu->remote, 0, __ATOMIC_ACQUIRE);
+    if (!cpu->free) slab_grow(self, cpu_id());
+
+    u64 obj = cpu->free;
+    cpu->free = SLAB_LINK(self, obj);
+    cpu->allocs++;
+
+    return obj;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates an aligned object using a Slab Allocator.
+///
+/// @param  self    A pointer to the Slab Allocator Structure.
+/// @param  n_bytes How many bytes to allocate (at most the object size).
+/// @param  align   The alignment (at most the alignment of the cache).
+///
+/// @returns    The pointer to the allocated object (in constructed state).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 slab_alloc_aligned(slab_allocator_t *self, u64 n_bytes, u64 align) {
+
+    if ((align & (align - 1)) || align > self->align)
+        panic("Slab Allocator: unsupported alignment %u for the %s cache\n", align, self->name);
+
+    return slab_alloc(self, n_bytes);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Frees an object using a Slab Allocator.
+///
+/// @param  self    The Slab Allocator that was used for allocating.
+/// @param  vaddr   The address of the object (has to be in constructed state again).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void slab_free(slab_allocator_t *self, u64 vaddr) {
+
+    slab_t *slab = (slab_t*)(vaddr & ~(PAGE_SIZE - 1));
+    if (slab->cache != self)
+        panic("Slab Allocator: %x is not an object of the %s cache\n", vaddr, self->name);
+
+    slab_cpu_t *owner = &self->cpus[slab->cpu];
+
+    if (slab->cpu == cpu_id()) {
+        SLAB_LINK(self, vaddr) = owner->free;
+        owner->free = vaddr;
+        owner->frees++;
+        return;
+    }
+
+    // lock-free push onto the remote stack of the owning CPU
+    u64 head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+    do {
+        SLAB_LINK(self, vaddr) = head;
+    } while (!__atomic_compare_exchange_n(
+                &owner->remote, &head, vaddr, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    self->cpus[cpu_id()].remote_frees++;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Initializes a Slab Allocator.
+///
+/// @param  self    The empty Slab Allocator Structure to fill.
+///
+/// No memory is allocated until the first object is requested.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void slab_init(slab_allocator_t *self) {
+
+    if (self->obj_size > SLAB_MAX_OBJ_SIZE)
+        panic("Slab Allocator: objects of the %s cache are too big\n", self->name);
+
+    if (self->align & (self->align - 1))
+        panic("Slab Allocator: unsupported alignment %u for the %s cache\n",
+                self->align, self->name);
+
+    if (self->align < sizeof(u64)) self->align = sizeof(u64);
+
+    // the link behind every object keeps the next object aligned as well
+    self->stride = (self->obj_size + 7) & ~7ull;
+    if (self->ctor || !self->stride) self->stride += sizeof(u64);
+    self->stride = (self->stride + self->align - 1) & ~(self->align - 1);
+    self->offset = (sizeof(slab_t) + self->align - 1) & ~(self->align - 1);
+    self->slabs = 0;
+
+    if (self->offset + self->stride > PAGE_SIZE)
+        panic("Slab Allocator: objects of the %s cache do not fit into a slab\n", self->name);
+
+    for (u64 i = 0; i < MAX_CPUS; i++) {
+        self->cpus[i].free = 0;
+        self->cpus[i].remote = 0;
+        self->cpus[i].allocs = 0;
+        self->cpus[i].frees = 0;
+        self->cpus[i].remote_frees = 0;
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns the usable size of an object of a Slab Allocator.
+///
+/// @param  self    A pointer to the Slab Allocator Structure.
+/// @param  vaddr   The address of the object.
+///
+/// @returns    The object size of the cache.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 slab_size(slab_allocator_t *self, u64 vaddr) {
+
+    return self->obj_size;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Adds a new slab to the free list of a CPU.
+///
+/// @param  self    A pointer to the Slab Allocator Structure.
+/// @param  cpu     The CPU the slab belongs to.
+///
+/// Runs the constructor on every object of the slab.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void slab_grow(slab_allocator_t *self, u64 cpu) {
+
+    slab_t *slab = (slab_t*)P2V(pmem_alloc(1, PMEM_ZONE_ANY));
+    slab->cache = self;
+    slab->cpu = cpu;
+
+    slab->next = __atomic_load_n(&self->slabs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(
+                &self->slabs, &slab->next, slab, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    u64 first = (u64)slab + self->offset;
+    u64 count = (PAGE_SIZE - self->offset) / self->stride;
+    u64 obj;
+
+    // push in reverse so the objects are handed out in ascending order
+    for (u64 i = count; i > 0; i--) {
+
+        obj = first + (i - 1) * self->stride;
+        if (self->ctor) self->ctor((void*)obj);
+
+        SLAB_LINK(self, obj) = self->cpus[cpu].free;
+        self->cpus[cpu].free = obj;
+    }
+
+    __atomic_fetch_add(&self->allocator.blocks, 1, __ATOMIC_RELAXED);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Writes the statistics of a Slab Allocator to debug.
+///
+/// @param  self    A pointer to the Slab Allocator Structure.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void slab_print_stats(slab_allocator_t *self) {
+
+    dbg_info("slab %s: %u byte objects (aligned to %u), %u per slab, %u slabs\n",
+            self->name, self->obj_size, self->align,
+            (PAGE_SIZE - self->offset) / self->stride, self->allocator.blocks);
+
+    for (u64 i = 0; i < MAX_CPUS; i++) {
+
+        if (!self->cpus[i].allocs && !self->cpus[i].frees && !self->cpus[i].remote_frees)
+            continue;
+
+        dbg_info("slab %s: cpu %u: %u allocs, %u frees, %u remote frees\n",
+                self->name, i,
+                self->cpus[i].allocs, self->cpus[i].frees, self->cpus[i].remote_frees);
+    }
+}
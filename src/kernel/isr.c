@@ -12,6 +12,7 @@
 #include <tty.h>
 #include <proc.h>
 #include <syscalls.h>
+#include <vma.h>
 
 
 /// @brief  Table of exception/IRQ isr stub function pointers (in assembly).
@@ -46,6 +47,8 @@ void isr_handler(int_args_t *args) {
     
     // exception
     if (args->int_vec < MAX_ERR) {
+        // missing pages of user address spaces are mapped on demand
+        if (args->int_vec == PAGE_FAULT_VEC && vma_fault(args)) return;
         err_handler(args);
         // should not return
     }
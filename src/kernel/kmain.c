@@ -12,27 +12,43 @@
 #include <idt.h>
 #include <pic.h>
 #include <isr.h>
+#include <syscalls.h>
 #include <err.h>
 #include <irq.h>
 #include <kbd.h>
 #include <pit.h>
 #include <pmem.h>
+#include <pmem_buddy.h>
+#include <pmem_cache.h>
+#include <pmem_zero.h>
+#include <pmem_stats.h>
+#include <pmem_ref.h>
+#include <tlb.h>
+#include <pmem_shrink.h>
 #include <vmem.h>
 #include <ata.h>
 #include <alloc.h>
 #include <buddy.h>
 #include <bump.h>
+#include <kmalloc.h>
+#include <arena.h>
 #include <vfs.h>
 #include <fat32.h>
 #include <x86.h>
 #include <tty.h>
 #include <proc.h>
+#include <vma.h>
 #include <elf64.h>
+#include <bench.h>
+#include <utils.h>
 
 
 /// @brief  Global variable holding a pointer to the bootinfo struct.
 bootinfo_t *bootinfo;
 
+/// @brief  Kernel owned copy of the bootinfo struct (the original is in reclaimed memory).
+u8 bootinfo_copy[sizeof(bootinfo_t) + MAX_REGIONS * sizeof(region_t)] ALIGNED(8);
+
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 /// @brief  Kernel's main entry point.
@@ -43,7 +59,12 @@ bootinfo_t *bootinfo;
 
 NORETURN void kmain(bootinfo_t *info) {
 
-    bootinfo = info;
+    // keep a copy as the bootloader memory is given back to the allocator later on
+    u32 num_regions = info->num_regions > MAX_REGIONS ? MAX_REGIONS : info->num_regions;
+    mem_cpy(bootinfo_copy, (u8*)info, sizeof(bootinfo_t) + num_regions * sizeof(region_t));
+    bootinfo = (bootinfo_t*)bootinfo_copy;
+    bootinfo->num_regions = num_regions;
+
     pv_base = bootinfo->kernel_map.virt;
 
     tty_init();
@@ -52,6 +73,20 @@ NORETURN void kmain(bootinfo_t *info) {
             "\n\nKernel filesize: %ukb\n\n", 
             bootinfo->kernel_filesize / 1000);
 
+    // regions that do not fit into the copy are ignored, their free memory is never used
+    u64 dropped_free = 0;
+    for (u32 i = MAX_REGIONS; i < info->num_regions; i++) {
+        if (info->regions[i].type == FREE) dropped_free += info->regions[i].length;
+    }
+
+    if (info->num_regions > MAX_REGIONS) {
+        tty_putf(
+                MIX(YELLOW, BLACK),
+                "Warning: %u of %u memory regions ignored (%ukb free memory lost)\n\n",
+                (u64)info->num_regions - MAX_REGIONS, (u64)info->num_regions,
+                dropped_free / 1024);
+    }
+
     x86_cli();
     gdt_init();
 //    ASM("mov    ax, 0x28");
@@ -59,27 +94,66 @@ NORETURN void kmain(bootinfo_t *info) {
 //    while(1);
     idt_init();
     isr_init();
+    syscall_init();
     pic_init();
     kbd_init();
     pit_init(1000);
     proc_init();
     pmem_init();
     vmem_init();
+    pmem_buddy_init();
+    pmem_cache_init();
+    pmem_zero_init();
+    pmem_stats_init();
+    pmem_ref_init();
+    kernel_heap_init();
+
+#if defined(ALLOC_STATS) || defined(ALLOC_TRACE)
+    // the trace buffer needs the Physical Memory Manager, proc_init runs before it
+    alloc_stats_enable(&pcb_cache.allocator, &pcb_cache_stats, "pcb cache");
+#endif
+
+    scratch_init();
     ata_init();
 
-    buddy_allocator_t heap = CREATE_BUDDY_ALLOCATOR(20);
-    heap.allocator.init(&heap);
-    
+#ifdef KERNEL_BENCH
+    bench_run();
+#endif
+
     fat32_t *fs = fat32_init(
-            (allocator_t*)&heap, 
+            (allocator_t*)&kernel_heap, 
             boot_drive, bootinfo->boot_partition, 
             (vbr_t*)P2V(bootinfo->vbr_addr)
             );
 
-    file_t *f = fat32_load_file(fs, (allocator_t*)&heap, "/PROG/HELLO.ELF");
-    pcb_t *proc1 = proc_create((allocator_t*)&heap, 0, "proc1", 5, f);
+    // the VBR and the bootloader are not needed anymore
+    pmem_reclaim();
+
+    file_t *f = fat32_load_file(fs, (allocator_t*)&kernel_heap, "/PROG/HELLO.ELF");
+    pcb_t *proc1 = proc_create((allocator_t*)&pcb_cache, 0, "proc1", 5, f);
+
+    pmem_stats_print();
+    kmalloc_print_stats(&kernel_heap);
+    alloc_stats_print((allocator_t*)&pcb_cache);
+    alloc_stats_print((allocator_t*)&kernel_heap);
+    alloc_trace_print((allocator_t*)&kernel_heap);
+
+#ifdef KERNEL_BENCH
+    slab_print_stats(&pcb_cache);
+    pmem_shrink_print_stats();
+    slab_print_stats(&vma_cache);
+    vma_print(proc1->vmas);
+    tlb_print_stats();
+#endif
+
     x86_sti();
-    while(1);
+
+    // idle: prepare zeroed pages until the next interrupt
+    while(1) {
+        pmem_shrink_idle();
+        pmem_zero_idle();
+        x86_hlt();
+    }
     switch_ctx(proc1);
 
     x86_sti();
@@ -7,31 +7,68 @@
 #include <types.h>
 #include <bootinfo.h>
 #include <pmem.h>
+#include <pmem_buddy.h>
+#include <pmem_cache.h>
+#include <pmem_zero.h>
+#include <pmem_stats.h>
+#include <pmem_shrink.h>
 #include <vmem.h>
 #include <err.h>
 #include <x86.h>
 #include <tty.h>
 #include <paging.h>
 #include <utils.h>
+#include <dbg.h>
 
 
 /// @brief  The bitmap used by the bitmap allocator.
 ///
 /// Contains a bit for each page frame: 0 -> unused, 1 -> used.
-u8 *bitmap;
+/// Block n is bit (n % 64) of word (n / 64), so a word can be scanned with a single bsf/tzcnt.
+u64 *bitmap;
 /// @brief  The bitmap size in bytes.
 u64 bitmap_byte_size;
 /// @brief  The bitmap size in bits (= number of pages/blocks).
 u64 bitmap_bit_size;
-
-/// @brief  The number of pages already allocated.
+/// @brief  The bitmap size in 64-bit words (= groups of 64 blocks).
+u64 bitmap_word_size;
+
+/// @brief  First summary level: bit n is set if the bitmap word n is entirely used.
+u64 *summary_full;
+/// @brief  First summary level: bit n is set if the bitmap word n is entirely unused.
+u64 *summary_empty;
+/// @brief  Second summary level: bit n is set if the summary_full word n is entirely set.
+u64 *summary_top;
+/// @brief  The size of the first summary level in 64-bit words.
+u64 summary_word_size;
+/// @brief  The size of the second summary level in 64-bit words.
+u64 summary_top_size;
+
+/// @brief  The size of all allocator metadata (bitmap + summaries) in pages.
+u64 pmem_meta_pages;
+
+/// @brief  The number of pages allocated by pmem_alloc* and not freed yet.
 u64 blocks_allocated = 0;
-/// @brief  Used by the bitmap allocator (next fit).
-u64 next = 0;
+
+/// @brief  The number of unused blocks in the bitmap (cached and pooled frames count as used).
+u64 pmem_free_blocks = 0;
+
+/// @brief  The physical memory zones (block ranges are set by pmem_zone_init).
+pmem_zone_t pmem_zones[MAX_ZONES] = {
+    [ZONE_DMA]      = {"DMA", 0, 0, 0, 0},
+    [ZONE_NORMAL]   = {"Normal", 0, 0, 0, 0},
+    [ZONE_HIGH]     = {"High", 0, 0, 0, 0},
+};
+
+/// @brief  The allocator backend used by pmem_alloc* (switched by pmem_buddy_init).
+pmem_backend_t pmem_backend = PMEM_BITMAP;
 
 /// @brief  The end of the kernel region in blocks.
 u64 kernel_region_end = 0;
 
+/// @brief  The end of the kernel image (defined by the linker script).
+extern u8 kernel_end[];
+
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 /// @brief  Initializes the Physical Memory Manager (bitmap allocator, next fit).
@@ -47,14 +84,23 @@ void pmem_init(void) {
     // calculate the size of the bitmap according to the usable memory range
     range_t range = pmem_get_usable_mem_range();
     bitmap_bit_size = (range.end - range.base) / PAGE_SIZE;
-    bitmap_byte_size = bitmap_bit_size / 8;
+
+    // round the bitmap up to whole 64-bit words so the summaries can work on full words
+    bitmap_word_size = (bitmap_bit_size + 63) / 64;
+    bitmap_byte_size = bitmap_word_size * sizeof(u64);
+    summary_word_size = (bitmap_word_size + 63) / 64;
+    summary_top_size = (summary_word_size + 63) / 64;
+
+    u64 meta_byte_size = bitmap_byte_size + 
+        (2 * summary_word_size + summary_top_size) * sizeof(u64);
+    pmem_meta_pages = page_round_up(meta_byte_size);
 
     // chose a location for the bitmap
     // get the first unused region that is big enough after the kernel load address
     u64 bitmap_addr = -1;
     for (u64 i = 0; i < bootinfo->num_regions; i++) {
         if (bootinfo->regions[i].type != FREE) continue;
-        if (bootinfo->regions[i].length < bitmap_byte_size) continue;
+        if (bootinfo->regions[i].length < meta_byte_size) continue;
         if (bootinfo->regions[i].base < bootinfo->kernel_load_addr) continue;
         if (bootinfo->regions[i].base > bitmap_addr) continue;
 
@@ -63,15 +109,21 @@ void pmem_init(void) {
 
     // panic if no region was found or if the mapped area is too small
     if (bitmap_addr == (u64)-1 || 
-        bitmap_addr + bitmap_byte_size > bootinfo->kernel_map.phys + bootinfo->kernel_map.size
+        bitmap_addr + meta_byte_size > bootinfo->kernel_map.phys + bootinfo->kernel_map.size
         ) panic("Couldn't find bitmap location");
 
-    bitmap = (u8*)P2V(bitmap_addr);
+    bitmap = (u64*)P2V(bitmap_addr);
+    summary_full = bitmap + bitmap_word_size;
+    summary_empty = summary_full + summary_word_size;
+    summary_top = summary_empty + summary_word_size;
     
     // BUILD BITMAP
 
-    // initilize to all used
+    // initilize to all used (summaries included, padding bits stay used forever)
     mem_set((u8*)bitmap, -1, bitmap_byte_size);
+    mem_set((u8*)summary_full, -1, summary_word_size * sizeof(u64));
+    mem_set((u8*)summary_empty, 0, summary_word_size * sizeof(u64));
+    mem_set((u8*)summary_top, -1, summary_top_size * sizeof(u64));
 
     u64 start_block;
     u64 end_block;
@@ -83,6 +135,9 @@ void pmem_init(void) {
 
         start_block = page_round_up(bootinfo->regions[i].base);
         end_block = page_round_down(bootinfo->regions[i].base + bootinfo->regions[i].length);
+        if (end_block > bitmap_bit_size) end_block = bitmap_bit_size;
+        if (start_block >= end_block) continue;
+
         pmem_bitmap_mark_blocks(
                     start_block,
                     end_block - start_block,
@@ -123,15 +178,216 @@ void pmem_init(void) {
     kernel_region_end = page_round_up(nearest_address);
     pmem_bitmap_mark_blocks(0, kernel_region_end, true);
 
-    // mark bitmap region as reserved
-    pmem_bitmap_mark_blocks(
-            page_round_down(V2P((u64)bitmap)), page_round_up(bitmap_byte_size), 
-            true);
+    // mark bitmap and summary region as reserved
+    pmem_bitmap_mark_blocks(page_round_down(V2P((u64)bitmap)), pmem_meta_pages, true);
+
+    pmem_zone_init();
+
+    pmem_free_blocks = 0;
+    for (u64 zone = 0; zone < MAX_ZONES; zone++)
+        pmem_free_blocks += pmem_zone_free_pages(&pmem_zones[zone]);
 
     tty_puts(WHITE_ON_BLACK, "Done!\n");
 }
 
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Gives memory that is only needed during boot back to the allocator.
+///
+/// @returns    The number of reclaimed pages.
+///
+/// Reclaims the ACPI reclaimable regions and the free low memory behind the kernel image 
+/// (bootloader, bootinfo, VBR) which pmem_init reserved as part of the kernel region.
+///
+/// @warning    Has to be called after the bootinfo struct has been copied and the VBR has been 
+///             read (fat32_init).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_reclaim(void) {
+
+    u64 reclaimed = 0;
+    u64 start_block;
+    u64 end_block;
+    u64 image_end = page_round_up(V2P((u64)kernel_end));
+
+    for (u64 i = 0; i < bootinfo->num_regions; i++) {
+
+        start_block = page_round_up(bootinfo->regions[i].base);
+        end_block = page_round_down(bootinfo->regions[i].base + bootinfo->regions[i].length);
+
+        if (bootinfo->regions[i].type == FREE) {
+
+            // only the part of the kernel region behind the kernel image (stays mapped,
+            // vmem_init mapped the whole kernel region like the direct map)
+            if (start_block < image_end) start_block = image_end;
+            if (end_block > kernel_region_end) end_block = kernel_region_end;
+            if (start_block >= end_block) continue;
+
+        } else if (bootinfo->regions[i].type != RECLAIMABLE) continue;
+
+        reclaimed += pmem_reclaim_range(start_block, end_block);
+    }
+
+    tty_putf(WHITE_ON_BLACK, "Reclaimed %u MiB (%u KiB) of boot memory\n", 
+            reclaimed * PAGE_SIZE / 0x100000, reclaimed * PAGE_SIZE / 0x400);
+
+    return reclaimed;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Releases all used blocks in a range.
+///
+/// @param  start_block The first block of the range.
+/// @param  end_block   The end of the range (exclusive).
+///
+/// @returns    The number of released blocks.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_reclaim_range(u64 start_block, u64 end_block) {
+
+    u64 released = 0;
+    u64 block = start_block;
+    u64 end;
+
+    if (end_block > bitmap_bit_size) end_block = bitmap_bit_size;
+
+    while ((block = pmem_next_used_block(block, end_block)) < end_block) {
+
+        end = pmem_next_free_block(block, end_block);
+        if (end == (u64)-1) end = end_block;
+
+        pmem_release_direct(block, end - block);
+        released += end - block;
+        block = end;
+    }
+
+    return released;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Sets up the block ranges of the memory zones.
+///
+/// The fixed zone limits are clipped to the usable memory range, so zones without memory 
+/// are empty. The usable pages of each zone are counted from the bitmap.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_zone_init(void) {
+
+    const u64 limits[MAX_ZONES] = {ZONE_DMA_END, ZONE_NORMAL_END, (u64)-1};
+    u64 start = 0;
+
+    for (u64 zone = 0; zone < MAX_ZONES; zone++) {
+
+        pmem_zones[zone].start = start < bitmap_bit_size ? start : bitmap_bit_size;
+        pmem_zones[zone].end = limits[zone] < bitmap_bit_size ? limits[zone] : bitmap_bit_size;
+        pmem_zones[zone].next = pmem_zones[zone].start;
+        pmem_zones[zone].pages = pmem_zone_free_pages(&pmem_zones[zone]);
+
+        start = limits[zone];
+    }
+
+    pmem_zone_print();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns the zones an allocation may use in the order they should be tried.
+///
+/// @param  flags   The zone flags of the allocation.
+/// @param  n       The index of the try.
+///
+/// @returns    The zone type of the n-th zone to try or -1 if all zones have been tried.
+///
+/// General allocations start at the highest zone, so the low zones stay free for devices.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_zone_nth(u64 flags, u64 n) {
+
+    u64 highest = ZONE_HIGH;
+    if (flags & PMEM_ZONE_DMA) highest = ZONE_DMA;
+    else if (flags & PMEM_ZONE_DMA32) highest = ZONE_NORMAL;
+
+    if (n > highest) return -1;
+    return (flags & PMEM_BOTTOM_UP) ? n : highest - n;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Searches for a region of a specified size inside a zone using the next fit method.
+///
+/// @param  zone    The zone to search.
+/// @param  size    The size of the requested region.
+///
+/// @returns    The start block of the found region or -1 if no region could be found.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_zone_find(pmem_zone_t *zone, u64 size) {
+
+    if (size == 0 || size > zone->end - zone->start) return -1;
+
+    // reset the next if the previous block has been freed
+    if (zone->next > zone->start && !pmem_bitmap_get_block(zone->next - 1)) 
+        zone->next = zone->start;
+    if (zone->next >= zone->end) zone->next = zone->start;
+
+    u64 block = pmem_find_run(zone->next, zone->end, size);
+
+    // wrap around (the region may overlap the old starting point)
+    if (block == (u64)-1 && zone->next > zone->start) {
+        u64 end = zone->next + size - 1;
+        if (end > zone->end) end = zone->end;
+        block = pmem_find_run(zone->start, end, size);
+    }
+
+    if (block != (u64)-1) zone->next = block + size;
+    return block;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Counts the unused blocks of a zone.
+///
+/// @param  zone    The zone to count.
+///
+/// @returns    The number of unused blocks.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_zone_free_pages(pmem_zone_t *zone) {
+
+    u64 pages = 0;
+    u64 block = zone->start;
+    u64 end;
+
+    while ((block = pmem_next_free_block(block, zone->end)) != (u64)-1) {
+
+        end = pmem_next_used_block(block, zone->end);
+        pages += end - block;
+        block = end;
+    }
+
+    return pages;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Writes the memory zones to debug.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_zone_print(void) {
+
+    for (u64 zone = 0; zone < MAX_ZONES; zone++) {
+        dbg_info("pmem zone %s: %x - %x, %u of %u pages free\n", 
+                pmem_zones[zone].name, 
+                pmem_zones[zone].start * PAGE_SIZE, 
+                pmem_zones[zone].end * PAGE_SIZE, 
+                pmem_zone_free_pages(&pmem_zones[zone]), 
+                pmem_zones[zone].pages);
+    }
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 /// @brief  Marks a block in the Physical Memory Allocator bitmap as used or unused.
 ///
@@ -141,14 +397,16 @@ void pmem_init(void) {
 
 void pmem_bitmap_mark_block(u64 block, bool used) {
 
-    u64 byte = block / 8;
-    u64 off = block % 8;
+    // keep pmem_free_blocks exact, the block may already be in the requested state
+    if (used != ((bitmap[block / 64] >> (block % 64)) & 1)) pmem_free_blocks += used ? -1 : 1;
 
     if (used) {
-        bitmap[byte] |= (1 << (7 - off));
+        bitmap[block / 64] |= 1ull << (block % 64);
     } else {
-        bitmap[byte] &= ~(1 << (7 - off));
+        bitmap[block / 64] &= ~(1ull << (block % 64));
     }
+
+    pmem_summary_update(block / 64);
 }
 
 
@@ -162,10 +420,7 @@ void pmem_bitmap_mark_block(u64 block, bool used) {
 
 bool pmem_bitmap_get_block(u64 block) {
 
-    u64 byte = block / 8;
-    u64 off = block % 8;
-
-    return (bitmap[byte] >> (7 - off)) & 1;
+    return (bitmap[block / 64] >> (block % 64)) & 1;
 }
 
 
@@ -179,20 +434,48 @@ bool pmem_bitmap_get_block(u64 block) {
 
 void pmem_bitmap_mark_blocks(u64 block, u64 count, bool used) {
 
-    for (; block % 8 && count > 0; ++block, --count)
-        pmem_bitmap_mark_block(block, used);
+    if (count == 0) return;
 
-    // speed things up by writing whole bytes
-    if (count >= 8) {
+    u64 first = block / 64;
+    u64 last = (block + count - 1) / 64;
+    u64 mask;
+
+    for (u64 word = first; word <= last; word++) {
+
+        // mask out the blocks in front of / behind the range in the first / last word
+        mask = -1;
+        if (word == first) mask &= ~0ull << (block % 64);
+        if (word == last) mask &= ~0ull >> (63 - (block + count - 1) % 64);
+
+        if (used) {
+            pmem_free_blocks -= pmem_count_bits(mask & ~bitmap[word]);
+            bitmap[word] |= mask;
+        } else {
+            pmem_free_blocks += pmem_count_bits(mask & bitmap[word]);
+            bitmap[word] &= ~mask;
+        }
 
-        mem_set(&bitmap[block / 8], used * -1, count / 8);
-        block += (count - count % 8);
-        count = count % 8;
+        pmem_summary_update(word);
     }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Counts the set bits of a bitmap word.
+///
+/// @param  word    The word.
+///
+/// @returns    The number of set bits.
+///
+/// __builtin_popcountll would need libgcc (no popcnt instruction without -mpopcnt).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_count_bits(u64 word) {
+
+    u64 count = 0;
 
-    // rest
-    for (; count > 0; ++block, --count)
-        pmem_bitmap_mark_block(block, used);
+    for (; word; count++) word &= word - 1;
+    return count;
 }
 
 
@@ -232,27 +515,21 @@ range_t pmem_get_usable_mem_range(void) {
 /// @brief  Allocates the specified amount of physical memory frames.
 ///
 /// @param  size    The amount of pages to allocate.
+/// @param  flags   The zone flags (PMEM_ZONE_*).
 ///
 /// @returns    A pointer to the beginning of the allocated region.
 ///
-/// @warning    Does NOT zero-initialize the region. DOES also map it to virtual memory.
+/// @warning    Does NOT zero-initialize the region. The region is accessible at P2V through the
+///             direct map (shared by all address spaces).
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-u64 pmem_alloc(pt_t pt4, u64 size) {
+u64 pmem_alloc(u64 size, u64 flags) {
 
-    u64 block = pmem_find_free_region(size);
+    u64 block = pmem_reserve_reclaim(size, flags);
     if (block == (u64)-1) panic("Out of memory");
 
-    vmem_map_region(
-            pt4,
-            bootinfo->kernel_map.virt + block * PAGE_SIZE, 
-            block * PAGE_SIZE, 
-            PAGE_WRITE, 
-            size);
-
-    pmem_bitmap_mark_blocks(block, size, true);
-    
-    blocks_allocated++;
+    blocks_allocated += size;
+    pmem_stats_alloc((u64)__builtin_return_address(0), block, size);
     return block * PAGE_SIZE;
 }
 
@@ -261,29 +538,34 @@ u64 pmem_alloc(pt_t pt4, u64 size) {
 /// @brief  Allocates (and zero-initializes) the specified amount of physical memory frames.
 ///
 /// @param  size    The amount of pages to allocate.
+/// @param  flags   The zone flags (PMEM_ZONE_*).
 ///
 /// @returns    A pointer to the beginning of the allocated region.
 ///
-/// @warning    DOES zero-initialize the region. DOES also map it to virtual memory.
+/// @warning    DOES zero-initialize the region. The region is accessible at P2V through the
+///             direct map (shared by all address spaces).
+///
+/// Unconstrained single pages are taken from the pre-zeroed pool if it is not empty.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-u64 pmem_alloc_clean(pt_t pt4, u64 size) {
+u64 pmem_alloc_clean(u64 size, u64 flags) {
 
-    u64 block = pmem_find_free_region(size);
-    if (block == (u64)-1) panic("Out of memory");
+    u64 block = (size == 1 && flags == PMEM_ZONE_ANY) ? pmem_zero_take() : (u64)-1;
+    if (block != (u64)-1) {
+        blocks_allocated++;
+        pmem_stats_alloc((u64)__builtin_return_address(0), block, 1);
+        return block * PAGE_SIZE;
+    }
 
-    vmem_map_region(
-            pt4,
-            bootinfo->kernel_map.virt + block * PAGE_SIZE,
-            block * PAGE_SIZE,
-            PAGE_WRITE, 
-            size);
+    block = pmem_reserve_reclaim(size, flags);
+    if (block == (u64)-1) panic("Out of memory");
 
-    pmem_bitmap_mark_blocks(block, size, true);
-    
-    mem_set((u8*)P2V(block * PAGE_SIZE), 0, size * PAGE_SIZE);
+    // the pool was empty or cannot serve the request
+    mem_zero_pages((u8*)P2V(block * PAGE_SIZE), size);
+    pmem_zero_pool.fallbacks++;
 
-    blocks_allocated++;
+    blocks_allocated += size;
+    pmem_stats_alloc((u64)__builtin_return_address(0), block, size);
     return block * PAGE_SIZE;
 }
 
@@ -293,39 +575,205 @@ u64 pmem_alloc_clean(pt_t pt4, u64 size) {
 /// the specified amount of physical memory frames without mapping.
 ///
 /// @param  size    The amount of pages to allocate.
+/// @param  flags   The zone flags (PMEM_ZONE_*).
 ///
 /// @returns    A pointer to the beginning of the allocated region.
 ///
 /// @warning    DOES zero-initialize the region. Does NOT map it to virtual memory.
+///
+/// The zones are always searched from the bottom up: the region has to be inside the bootloader 
+/// mapping, which vmem_init uses to build the kernel page tables.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-u64 pmem_alloc_raw(u64 size) {
+u64 pmem_alloc_raw(u64 size, u64 flags) {
 
-    u64 block = pmem_find_free_region(size);
+    u64 block = pmem_reserve_reclaim(size, flags | PMEM_BOTTOM_UP);
     if (block == (u64)-1) panic("Out of memory");
 
-    pmem_bitmap_mark_blocks(block, size, true);
-    
-    mem_set((u8*)P2V(block * PAGE_SIZE), 0, size * PAGE_SIZE);
+    mem_zero_pages((u8*)P2V(block * PAGE_SIZE), size);
 
-    blocks_allocated++;
+    blocks_allocated += size;
+    pmem_stats_alloc((u64)__builtin_return_address(0), block, size);
     return block * PAGE_SIZE;
 }
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-/// @brief  Frees and unmaps the specified amount of physical memory frames.
+/// @brief  Frees the specified amount of physical memory frames.
 ///
 /// @param  base_addr   The base address of the region to deallocate.
 /// @param  size        The amount of pages to deallocate.
 ///
-/// @warning    DOES also unmap the region.
+/// The region stays in the direct map, other mappings of it have to be removed by the caller.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_free(u64 base_addr, u64 size) {
+
+    pmem_release(base_addr / PAGE_SIZE, size);
+
+    blocks_allocated -= size;
+    pmem_stats_free(base_addr / PAGE_SIZE, size);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Frees a batch of scattered physical memory frames.
+///
+/// @param  addrs   The physical addresses of the frames (one page each). Gets sorted in place.
+/// @param  count   The number of frames.
+///
+/// Neighbouring frames are coalesced, so every run is cleared from the bitmap (and merged in
+/// the buddy backend) at once.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_free_batch(u64 *addrs, u64 count) {
+
+    u64 start;
+    u64 size;
+
+    // every frame is an allocation of its own
+    for (u64 i = 0; i < count; i++) pmem_stats_free(addrs[i] / PAGE_SIZE, 1);
+    blocks_allocated -= count;
+
+    pmem_sort(addrs, count);
+
+    for (u64 i = 0; i < count; i += size) {
+
+        start = addrs[i] / PAGE_SIZE;
+        for (size = 1; i + size < count && addrs[i + size] / PAGE_SIZE == start + size; size++);
+
+        pmem_release(start, size);
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Sorts an array of addresses in ascending order (shell sort).
+///
+/// @param  addrs   The array to sort.
+/// @param  count   The number of entries.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_sort(u64 *addrs, u64 count) {
+
+    u64 tmp;
+    u64 j;
+
+    for (u64 gap = count / 2; gap > 0; gap /= 2) {
+        for (u64 i = gap; i < count; i++) {
+
+            tmp = addrs[i];
+            for (j = i; j >= gap && addrs[j - gap] > tmp; j -= gap) addrs[j] = addrs[j - gap];
+            addrs[j] = tmp;
+        }
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Reserves physical memory frames.
+///
+/// @param  size    The amount of pages to reserve.
+/// @param  flags   The zone flags (PMEM_ZONE_*).
+///
+/// @returns    The first block of the region or -1 if there is not enough memory.
+///
+/// Unconstrained single pages are taken from the per-CPU cache, 
+/// everything else from the active backend.
+///
+/// @warning    Does NOT map or zero-initialize the region.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_reserve(u64 size, u64 flags) {
+
+    if (size == 1 && flags == PMEM_ZONE_ANY && pmem_cache_enabled) return pmem_cache_alloc();
+    return pmem_reserve_direct(size, flags);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Releases physical memory frames.
+///
+/// @param  block   The first block of the region.
+/// @param  size    The amount of pages to release.
+///
+/// Single pages are put into the per-CPU cache, everything else goes back to the backend.
+/// ZONE_DMA pages always go back, so they don't end up in general allocations.
+///
+/// @warning    Does NOT unmap the region.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_release(u64 block, u64 size) {
+
+    if (size == 1 && pmem_cache_enabled && pmem_zone_of(block) != ZONE_DMA) 
+        pmem_cache_free(block);
+    else pmem_release_direct(block, size);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Takes physical memory frames, shrinking the caches if there is not enough memory.
+///
+/// @param  size    The amount of pages to reserve.
+/// @param  flags   The zone flags (PMEM_ZONE_*).
+///
+/// @returns    The first block of the region or -1 if there is still not enough memory.
+///
+/// The shrinkers are asked for the missing pages first and for everything they have if the
+/// freed pages are not contiguous.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_reserve_reclaim(u64 size, u64 flags) {
+
+    u64 block = pmem_reserve(size, flags);
+    if (block != (u64)-1) return block;
+
+    pmem_shrink(size);
+    block = pmem_reserve(size, flags);
+    if (block != (u64)-1) return block;
+
+    pmem_shrink(-1);
+    return pmem_reserve(size, flags);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Takes physical memory frames from the active backend and marks them as used.
+///
+/// @param  size    The amount of pages to reserve.
+/// @param  flags   The zone flags (PMEM_ZONE_*).
+///
+/// @returns    The first block of the region or -1 if there is not enough memory.
+///
+/// @warning    Does NOT map or zero-initialize the region. Bypasses the per-CPU caches.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_reserve_direct(u64 size, u64 flags) {
+
+    u64 block;
+    if (pmem_backend == PMEM_BUDDY) block = pmem_buddy_alloc(size, flags);
+    else block = pmem_find_free_region(size, flags);
+
+    if (block == (u64)-1) return -1;
+
+    pmem_bitmap_mark_blocks(block, size, true);
+    return block;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns physical memory frames to the active backend and marks them as unused.
+///
+/// @param  block   The first block of the region.
+/// @param  size    The amount of pages to release.
+///
+/// @warning    Does NOT unmap the region. Bypasses the per-CPU caches.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-void pmem_free(pt_t pt4, u64 base_addr, u64 size) {
+void pmem_release_direct(u64 block, u64 size) {
 
-    vmem_unmap_region(pt4, base_addr, size);
-    pmem_bitmap_mark_blocks(base_addr / PAGE_SIZE, size, false);
+    pmem_bitmap_mark_blocks(block, size, false);
+    if (pmem_backend == PMEM_BUDDY) pmem_buddy_free(block, size);
 }
 
 
@@ -333,40 +781,206 @@ void pmem_free(pt_t pt4, u64 base_addr, u64 size) {
 /// @brief  Searches for a region of a specified size using the next fit method.
 ///
 /// @param  size    The size of the requested region.
+/// @param  flags   The zone flags (PMEM_ZONE_*).
 ///
 /// @returns    The start block of the found region or -1 if no region could be found.
+///
+/// The allowed zones are searched one after another (see pmem_zone_nth), a region never 
+/// crosses a zone boundary. Fully used bitmap words are skipped using the summary index, so the 
+/// search cost depends on the number of partially used words instead of the total amount of memory.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
-u64 pmem_find_free_region(u64 size) {
+u64 pmem_find_free_region(u64 size, u64 flags) {
 
-    // reset the next if the previous block has been freed
-    if (next > 0 && !pmem_bitmap_get_block(next - 1)) next = 0;
+    u64 zone;
+    u64 block;
+
+    for (u64 n = 0; (zone = pmem_zone_nth(flags, n)) != (u64)-1; n++) {
+
+        block = pmem_zone_find(&pmem_zones[zone], size);
+        if (block != (u64)-1) return block;
+    }
 
-    u64 cur_size = 0;
-    u64 cur_start = next % bitmap_bit_size;
-    u64 cur_block = 0;
+    return -1;
+}
 
-    for (u64 i = 0; i < bitmap_bit_size; i++) {
 
-        cur_block = (next + i) % bitmap_bit_size;
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Searches for the first run of unused blocks of a specified size inside a range.
+///
+/// @param  from    The first block of the range.
+/// @param  to      The end of the range (exclusive).
+/// @param  size    The size of the requested region.
+///
+/// @returns    The start block of the found region or -1 if no region could be found.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_find_run(u64 from, u64 to, u64 size) {
 
-        if (cur_block == 0) {
-            cur_size = 0;
-            cur_start = 0;
+    u64 start = from;
+    u64 end;
+
+    while (start + size <= to) {
+
+        start = pmem_next_free_block(start, to);
+        if (start == (u64)-1 || start + size > to) return -1;
+
+        end = pmem_next_used_block(start, start + size);
+        if (end == start + size) return start;
+
+        // continue behind the used block that interrupted the run
+        start = end + 1;
+    }
+
+    return -1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Searches for the next unused block.
+///
+/// @param  block   The block to start searching from.
+/// @param  to      The end of the search range (exclusive).
+///
+/// @returns    The first unused block in [block, to) or -1 if there is none.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_next_free_block(u64 block, u64 to) {
+
+    u64 free;
+
+    while (block < to) {
+
+        // jump over entirely used words using the summary index
+        if (pmem_summary_get(summary_full, block / 64)) {
+            u64 word = pmem_summary_next_clear(block / 64 + 1);
+            if (word == (u64)-1) return -1;
+            block = word * 64;
+            continue;
         }
-        
-        if (pmem_bitmap_get_block(cur_block)) {
-            cur_size = 0;
-            cur_start = cur_block + 1;
-        } else {
-        
-            cur_size++;
-            if (cur_size >= size) {
-                next = (cur_start + 1) % bitmap_bit_size;
-                return cur_start;
-            }
+
+        // unused blocks in the rest of the word
+        free = ~bitmap[block / 64] & (~0ull << (block % 64));
+        if (free) {
+            block = (block / 64) * 64 + __builtin_ctzll(free);
+            return block < to ? block : (u64)-1;
         }
+
+        block = (block / 64 + 1) * 64;
     }
 
     return -1;
 }
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Searches for the next used block.
+///
+/// @param  block   The block to start searching from.
+/// @param  to      The end of the search range (exclusive).
+///
+/// @returns    The first used block in [block, to) or to if all of them are unused.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_next_used_block(u64 block, u64 to) {
+
+    u64 used;
+    u64 word;
+
+    while (block < to) {
+
+        // used blocks in the rest of the word
+        used = bitmap[block / 64] & (~0ull << (block % 64));
+        if (used) {
+            block = (block / 64) * 64 + __builtin_ctzll(used);
+            return block < to ? block : to;
+        }
+
+        // jump over entirely unused words using the summary index
+        word = block / 64 + 1;
+        while (word * 64 < to && pmem_summary_get(summary_empty, word)) {
+            if (word % 64 == 0 && summary_empty[word / 64] == (u64)-1) word += 64;
+            else word++;
+        }
+
+        block = word * 64;
+    }
+
+    return to;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Checks a bit of a summary level.
+///
+/// @param  summary The summary level (summary_full or summary_empty).
+/// @param  word    The bitmap word the bit belongs to.
+///
+/// @returns    The value of the bit.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool pmem_summary_get(u64 *summary, u64 word) {
+
+    return (summary[word / 64] >> (word % 64)) & 1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Searches for the next bitmap word that is not entirely used.
+///
+/// @param  word    The bitmap word to start searching from.
+///
+/// @returns    The index of the bitmap word or -1 if all remaining words are used.
+///
+/// Walks down from the top summary level, so it never touches more than a few words.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_summary_next_clear(u64 word) {
+
+    if (word >= bitmap_word_size) return -1;
+
+    // rest of the current summary word
+    u64 free = ~summary_full[word / 64] & (~0ull << (word % 64));
+    if (free) return (word / 64) * 64 + __builtin_ctzll(free);
+
+    // find the next summary word which is not entirely set using the top level
+    u64 sum = word / 64 + 1;
+    while (sum < summary_word_size) {
+
+        free = ~summary_top[sum / 64] & (~0ull << (sum % 64));
+        if (!free) {
+            sum = (sum / 64 + 1) * 64;
+            continue;
+        }
+        sum = (sum / 64) * 64 + __builtin_ctzll(free);
+        if (sum >= summary_word_size) break;
+
+        return sum * 64 + __builtin_ctzll(~summary_full[sum]);
+    }
+
+    return -1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Updates the summary bits of a bitmap word after it has been modified.
+///
+/// @param  word    The index of the modified bitmap word.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_summary_update(u64 word) {
+
+    u64 value = bitmap[word];
+    u64 sum = word / 64;
+    u64 bit = 1ull << (word % 64);
+
+    if (value == (u64)-1) summary_full[sum] |= bit;
+    else summary_full[sum] &= ~bit;
+
+    if (value == 0) summary_empty[sum] |= bit;
+    else summary_empty[sum] &= ~bit;
+
+    bit = 1ull << (sum % 64);
+    if (summary_full[sum] == (u64)-1) summary_top[sum / 64] |= bit;
+    else summary_top[sum / 64] &= ~bit;
+}
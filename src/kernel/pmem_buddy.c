@@ -0,0 +1,342 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Buddy backend of the Physical Memory Manager.
+///
+/// Keeps a free list per zone and order (1 to 1024 pages). The bitmap stays the source of truth:
+/// the free lists are built from it and every allocation/free still updates it.
+/// The zone limits are multiples of the largest block size, so blocks never cross a zone.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <types.h>
+#include <paging.h>
+#include <pmem.h>
+#include <pmem_buddy.h>
+#include <vmem.h>
+#include <err.h>
+#include <tty.h>
+#include <x86.h>
+#include <dbg.h>
+
+
+/// @brief  Per page frame data (bitmap_bit_size entries).
+frame_t *frames;
+
+/// @brief  The first free block of each zone and order (FRAME_NIL if empty).
+u32 free_lists[MAX_ZONES][PMEM_ORDERS];
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Initializes the buddy backend and switches the Physical Memory Manager to it.
+///
+/// @warning    Has to be called after vmem_init (the frame data is mapped by pmem_alloc).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_buddy_init(void) {
+
+    tty_puts(WHITE_ON_BLACK, "Setting up PMEM buddy...");
+
+    frames = (frame_t*)P2V(pmem_alloc(
+                page_round_up(bitmap_bit_size * sizeof(frame_t)),
+                PMEM_ZONE_ANY));
+
+    for (u64 zone = 0; zone < MAX_ZONES; zone++) {
+        for (u64 order = 0; order < PMEM_ORDERS; order++) free_lists[zone][order] = FRAME_NIL;
+    }
+    for (u64 block = 0; block < bitmap_bit_size; block++) frames[block].flags = 0;
+
+    // build the free lists from the runs of unused blocks in the bitmap
+    u64 block = 0;
+    u64 end;
+    while ((block = pmem_next_free_block(block, bitmap_bit_size)) != (u64)-1) {
+
+        end = pmem_next_used_block(block, bitmap_bit_size);
+        pmem_buddy_free(block, end - block);
+        block = end;
+    }
+
+    pmem_backend = PMEM_BUDDY;
+
+    tty_puts(WHITE_ON_BLACK, "Done!\n");
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Calculates the smallest order that can hold a region.
+///
+/// @param  size    The size of the region in pages.
+///
+/// @returns    The order (log2 of the size, rounded up).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_buddy_order(u64 size) {
+
+    if (size <= 1) return 0;
+    return 64 - __builtin_clzll(size - 1);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Takes a region off the free lists.
+///
+/// @param  size    The size of the region in pages.
+/// @param  flags   The zone flags (PMEM_ZONE_*).
+///
+/// @returns    The first block of the region or -1 if there is no region big enough.
+///
+/// The allowed zones are tried in the order given by pmem_zone_nth.
+/// Does NOT mark the bitmap.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_buddy_alloc(u64 size, u64 flags) {
+
+    u64 zone;
+    u64 block;
+
+    for (u64 n = 0; (zone = pmem_zone_nth(flags, n)) != (u64)-1; n++) {
+
+        block = pmem_buddy_zone_alloc(zone, size);
+        if (block != (u64)-1) return block;
+    }
+
+    return -1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Takes a region off the free lists of a zone.
+///
+/// @param  zone    The zone to allocate from.
+/// @param  size    The size of the region in pages.
+///
+/// @returns    The first block of the region or -1 if there is no region big enough.
+///
+/// The unused tail of the power of two sized block is put back onto the free lists.
+/// Does NOT mark the bitmap.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_buddy_zone_alloc(u64 zone, u64 size) {
+
+    u64 want = pmem_buddy_order(size);
+    u64 order = want;
+    u64 block;
+
+    while (order < PMEM_ORDERS && free_lists[zone][order] == FRAME_NIL) order++;
+
+    // too big for the free lists or only split up blocks left:
+    // search the bitmap for an unaligned run and cut it out of the lists
+    if (order >= PMEM_ORDERS) {
+
+        block = pmem_zone_find(&pmem_zones[zone], size);
+        if (block != (u64)-1) pmem_buddy_carve(block, size);
+        return block;
+    }
+
+    block = free_lists[zone][order];
+    pmem_buddy_remove(block);
+
+    // split until the block has the requested order
+    while (order > want) {
+        order--;
+        pmem_buddy_push(block + (1ull << order), order);
+    }
+
+    // give back the tail
+    if ((1ull << order) > size) pmem_buddy_free(block + size, (1ull << order) - size);
+
+    return block;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Puts a region onto the free lists.
+///
+/// @param  block   The first block of the region.
+/// @param  size    The size of the region in pages.
+///
+/// Splits the region into naturally aligned power of two blocks and merges each of them with 
+/// its free buddies. Does NOT mark the bitmap.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_buddy_free(u64 block, u64 size) {
+
+    u64 order;
+    u64 buddy;
+    u64 cur;
+
+    while (size > 0) {
+
+        // largest aligned block that starts here and fits into the region
+        order = block ? __builtin_ctzll(block) : PMEM_MAX_ORDER;
+        if (order > PMEM_MAX_ORDER) order = PMEM_MAX_ORDER;
+        while ((1ull << order) > size) order--;
+
+        size -= 1ull << order;
+        cur = block;
+        block += 1ull << order;
+
+        // merge with free buddies
+        while (order < PMEM_MAX_ORDER) {
+
+            buddy = cur ^ (1ull << order);
+            if (buddy >= bitmap_bit_size) break;
+            if (!(frames[buddy].flags & FRAME_FREE) || frames[buddy].order != order) break;
+
+            pmem_buddy_remove(buddy);
+            if (buddy < cur) cur = buddy;
+            order++;
+        }
+
+        pmem_buddy_push(cur, order);
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Removes an arbitrary region from the free lists.
+///
+/// @param  block   The first block of the region.
+/// @param  size    The size of the region in pages.
+///
+/// Free blocks overlapping the region are split, the parts outside of it stay free.
+/// Blocks of the region that are not on the free lists are ignored.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_buddy_carve(u64 block, u64 size) {
+
+    u64 end = block + size;
+    u64 head;
+    u64 order;
+
+    while (block < end) {
+
+        // search the free block containing the current block
+        for (order = 0; order < PMEM_ORDERS; order++) {
+
+            head = block & ~((1ull << order) - 1);
+            if ((frames[head].flags & FRAME_FREE) && frames[head].order == order) break;
+        }
+
+        if (order == PMEM_ORDERS) {
+            block++;
+            continue;
+        }
+
+        pmem_buddy_remove(head);
+
+        // return the parts in front of and behind the region
+        if (head < block) pmem_buddy_free(head, block - head);
+        if (head + (1ull << order) > end) 
+            pmem_buddy_free(end, head + (1ull << order) - end);
+
+        block = head + (1ull << order);
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Pushes a free block onto the free list of its zone and order.
+///
+/// @param  block   The first block (page frame number) of the free block.
+/// @param  order   The order of the free block.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_buddy_push(u64 block, u64 order) {
+
+    u32 *list = &free_lists[pmem_zone_of(block)][order];
+
+    frames[block].flags |= FRAME_FREE;
+    frames[block].order = order;
+    frames[block].prev = FRAME_NIL;
+    frames[block].next = *list;
+
+    if (*list != FRAME_NIL) frames[*list].prev = block;
+    *list = block;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Removes a free block from the free list of its zone and order.
+///
+/// @param  block   The first block (page frame number) of the free block.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_buddy_remove(u64 block) {
+
+    frame_t *frame = &frames[block];
+
+    if (frame->prev != FRAME_NIL) frames[frame->prev].next = frame->next;
+    else free_lists[pmem_zone_of(block)][frame->order] = frame->next;
+
+    if (frame->next != FRAME_NIL) frames[frame->next].prev = frame->prev;
+
+    frame->flags &= ~FRAME_FREE;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Collects fragmentation statistics.
+///
+/// @param  stats   The structure to fill.
+///
+/// The fragmentation index of an order is the share of free memory that can not be used for
+/// an allocation of that order because it is split into smaller blocks.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_buddy_stats(pmem_buddy_stats_t *stats) {
+
+    u64 count;
+
+    stats->free_pages = 0;
+    stats->largest_order = 0;
+    for (u64 zone = 0; zone < MAX_ZONES; zone++) stats->zone_free_pages[zone] = 0;
+
+    for (u64 order = 0; order < PMEM_ORDERS; order++) {
+
+        stats->free_blocks[order] = 0;
+        for (u64 zone = 0; zone < MAX_ZONES; zone++) {
+
+            count = 0;
+            u32 block = free_lists[zone][order];
+            for (; block != FRAME_NIL; block = frames[block].next) count++;
+
+            stats->free_blocks[order] += count;
+            stats->zone_free_pages[zone] += count << order;
+        }
+
+        stats->free_pages += stats->free_blocks[order] << order;
+        if (stats->free_blocks[order]) stats->largest_order = order;
+    }
+
+    u64 usable = stats->free_pages;
+    for (u64 order = 0; order < PMEM_ORDERS; order++) {
+
+        stats->frag_index[order] = stats->free_pages 
+            ? (stats->free_pages - usable) * 100 / stats->free_pages 
+            : 0;
+        usable -= stats->free_blocks[order] << order;
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Writes the fragmentation statistics to debug.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_buddy_print_stats(void) {
+
+    pmem_buddy_stats_t stats;
+    pmem_buddy_stats(&stats);
+
+    dbg_info("pmem buddy: %u free pages, largest order %u\n", 
+            stats.free_pages, stats.largest_order);
+
+    for (u64 zone = 0; zone < MAX_ZONES; zone++) {
+        dbg_info("pmem buddy: zone %s: %u free pages\n", 
+                pmem_zones[zone].name, stats.zone_free_pages[zone]);
+    }
+
+    for (u64 order = 0; order < PMEM_ORDERS; order++) {
+        dbg_info("pmem buddy: order %u: %u free blocks, fragmentation %u%%\n", 
+                order, stats.free_blocks[order], stats.frag_index[order]);
+    }
+}
@@ -0,0 +1,154 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Per-CPU page frame caches in front of the Physical Memory Manager backends.
+///
+/// Single page allocations and frees are served from a per-CPU magazine. The magazine is
+/// refilled from and drained to the backend in batches of PMEM_CACHE_BATCH pages, so the
+/// common path touches nothing but the local cache.
+///
+/// @note   Cached frames are marked as used in the bitmap.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <types.h>
+#include <cpu.h>
+#include <pmem.h>
+#include <pmem_cache.h>
+#include <tty.h>
+#include <dbg.h>
+
+
+/// @brief  One page frame cache per CPU.
+pmem_cache_t pmem_caches[MAX_CPUS];
+
+/// @brief  Set once the caches are ready to use.
+bool pmem_cache_enabled = false;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Initializes the page frame caches and routes single page allocations through them.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_cache_init(void) {
+
+    tty_puts(WHITE_ON_BLACK, "Setting up PMEM caches...");
+
+    for (u64 cpu = 0; cpu < MAX_CPUS; cpu++) {
+        pmem_caches[cpu].count = 0;
+        pmem_caches[cpu].hits = 0;
+        pmem_caches[cpu].misses = 0;
+        pmem_caches[cpu].refills = 0;
+        pmem_caches[cpu].drains = 0;
+    }
+    pmem_cache_enabled = true;
+
+    tty_puts(WHITE_ON_BLACK, "Done!\n");
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Takes a single page frame from the cache of the executing CPU.
+///
+/// @returns    The block number of the page frame or -1 if there is no memory left.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_cache_alloc(void) {
+
+    pmem_cache_t *cache = &pmem_caches[cpu_id()];
+
+    if (cache->count == 0) {
+        cache->misses++;
+        pmem_cache_refill(cache);
+        if (cache->count == 0) return -1;
+    } else {
+        cache->hits++;
+    }
+
+    return cache->blocks[--cache->count];
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Puts a single page frame into the cache of the executing CPU.
+///
+/// @param  block   The block number of the page frame.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_cache_free(u64 block) {
+
+    pmem_cache_t *cache = &pmem_caches[cpu_id()];
+
+    if (cache->count == PMEM_CACHE_SIZE) pmem_cache_drain(cache, PMEM_CACHE_BATCH);
+    cache->blocks[cache->count++] = block;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Refills a cache with a batch of page frames from the backend.
+///
+/// @param  cache   The cache to refill.
+///
+/// Tries to get the whole batch as one contiguous region first.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_cache_refill(pmem_cache_t *cache) {
+
+    u64 block = pmem_reserve_direct(PMEM_CACHE_BATCH, PMEM_ZONE_ANY);
+
+    if (block != (u64)-1) {
+
+        // push in reverse so the frames are handed out in ascending order
+        for (u64 i = PMEM_CACHE_BATCH; i > 0; i--) 
+            cache->blocks[cache->count++] = block + i - 1;
+
+    } else {
+
+        while (cache->count < PMEM_CACHE_BATCH) {
+            block = pmem_reserve_direct(1, PMEM_ZONE_ANY);
+            if (block == (u64)-1) break;
+            cache->blocks[cache->count++] = block;
+        }
+    }
+
+    cache->refills++;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns page frames from a cache to the backend.
+///
+/// @param  cache   The cache to drain.
+/// @param  count   How many page frames to return (the oldest ones first).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_cache_drain(pmem_cache_t *cache, u64 count) {
+
+    if (count > cache->count) count = cache->count;
+
+    for (u64 i = 0; i < count; i++) pmem_release_direct(cache->blocks[i], 1);
+    for (u64 i = count; i < cache->count; i++) cache->blocks[i - count] = cache->blocks[i];
+
+    cache->count -= count;
+    cache->drains++;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Writes the cache statistics to debug.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_cache_print_stats(void) {
+
+    pmem_cache_t *cache;
+    u64 total;
+
+    for (u64 cpu = 0; cpu < MAX_CPUS; cpu++) {
+
+        cache = &pmem_caches[cpu];
+        total = cache->hits + cache->misses;
+        if (total == 0) continue;
+
+        dbg_info("pmem cache %u: %u cached, hit rate %u%% (%u/%u), %u refills, %u drains\n",
+                cpu, cache->count, cache->hits * 100 / total, cache->hits, total,
+                cache->refills, cache->drains);
+    }
+}
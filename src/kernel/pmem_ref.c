@@ -0,0 +1,83 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Reference counts of page frames shared between address spaces.
+///
+/// A frame has a single owner until an address space is cloned (see vmem_clone_address_space),
+/// so only the additional sharers are counted and ordinary allocations never touch the counts.
+/// The last owner frees the frame with pmem_ref_put.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <types.h>
+#include <paging.h>
+#include <pmem.h>
+#include <pmem_ref.h>
+#include <vmem.h>
+#include <utils.h>
+#include <err.h>
+#include <tty.h>
+#include <x86.h>
+
+
+/// @brief  Number of additional address spaces mapping each page frame (0 = not shared).
+u16 *pmem_refs = 0;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Initializes the page frame reference counts.
+///
+/// @warning    Has to be called after vmem_init.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_ref_init(void) {
+
+    u64 pages = page_round_up(bitmap_bit_size * sizeof(u16));
+    pmem_refs = (u16*)P2V(pmem_alloc_clean(pages, PMEM_ZONE_ANY));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Adds a sharer to a page frame.
+///
+/// @param  paddr   The physical address of the frame.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_ref_get(u64 paddr) {
+
+    if (!__atomic_add_fetch(&pmem_refs[paddr / PAGE_SIZE], 1, __ATOMIC_RELAXED))
+        panic("Too many references to page frame %x\n", paddr);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Removes a sharer from a page frame and frees it if it was the last one.
+///
+/// @param  paddr   The physical address of the frame.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_ref_put(u64 paddr) {
+
+    u16 *refs = &pmem_refs[paddr / PAGE_SIZE];
+    u16 count = __atomic_load_n(refs, __ATOMIC_RELAXED);
+
+    do {
+        if (count == 0) {
+            pmem_free(page_base(paddr), 1);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(
+                refs, &count, count - 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns the number of additional sharers of a page frame.
+///
+/// @param  paddr   The physical address of the frame.
+///
+/// @returns    0 if the frame has a single owner.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_ref_count(u64 paddr) {
+
+    return __atomic_load_n(&pmem_refs[paddr / PAGE_SIZE], __ATOMIC_ACQUIRE);
+}
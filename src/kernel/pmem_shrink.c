@@ -0,0 +1,114 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Cache shrinkers of the Physical Memory Manager.
+///
+/// Subsystems caching memory (page frame pools, heaps, arenas) register a callback that gives
+/// memory back. The callbacks are invoked in registration order when an allocation is about to
+/// fail and from the idle loop when the free pages drop below PMEM_LOW_WATERMARK, so memory
+/// pressure shrinks the caches instead of ending in an "Out of memory" panic.
+///
+/// @warning    Shrinkers run in the context of the failing allocation. They must not block on
+///             locks the allocating code might hold (use spin_trylock) and must only touch the
+///             per-CPU data of the executing CPU.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <types.h>
+#include <cpu.h>
+#include <pmem.h>
+#include <pmem_cache.h>
+#include <pmem_shrink.h>
+#include <err.h>
+#include <tty.h>
+#include <x86.h>
+#include <dbg.h>
+
+
+/// @brief  The registered shrinkers.
+pmem_shrinker_t pmem_shrinkers[PMEM_MAX_SHRINKERS];
+/// @brief  The number of registered shrinkers.
+u64 pmem_shrinkers_count = 0;
+
+/// @brief  Set while the shrinkers run (they may allocate or free memory themselves).
+bool pmem_shrinking = false;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Registers a shrinker.
+///
+/// @param  name    The name shown in the statistics.
+/// @param  shrink  The callback, releases up to the given number of pages and returns how many
+///                 it freed.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_shrinker_register(const char *name, u64 (*shrink)(u64 pages)) {
+
+    if (pmem_shrinkers_count >= PMEM_MAX_SHRINKERS) panic("Too many shrinkers");
+
+    pmem_shrinkers[pmem_shrinkers_count++] = (pmem_shrinker_t) { name, shrink, 0, 0 };
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Asks the registered shrinkers to release memory.
+///
+/// @param  pages   How many pages should be freed (-1 = as many as possible).
+///
+/// @returns    The number of pages the shrinkers freed.
+///
+/// Stops as soon as enough pages are freed. The page frame cache of the executing CPU is
+/// drained afterwards, so the freed single pages are available to contiguous allocations.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_shrink(u64 pages) {
+
+    pmem_shrinker_t *shrinker;
+    u64 freed = 0;
+    u64 n;
+
+    if (__atomic_exchange_n(&pmem_shrinking, true, __ATOMIC_ACQUIRE)) return 0;
+
+    for (u64 i = 0; i < pmem_shrinkers_count && freed < pages; i++) {
+
+        shrinker = &pmem_shrinkers[i];
+        n = shrinker->shrink(pages - freed);
+
+        shrinker->calls++;
+        shrinker->freed += n;
+        freed += n;
+    }
+
+    if (pmem_cache_enabled) pmem_cache_drain(&pmem_caches[cpu_id()], PMEM_CACHE_SIZE);
+
+    __atomic_store_n(&pmem_shrinking, false, __ATOMIC_RELEASE);
+    return freed;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Shrinks the caches if the free memory is below the low watermark.
+///
+/// Called whenever the CPU has nothing else to do.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_shrink_idle(void) {
+
+    if (pmem_free_blocks >= PMEM_LOW_WATERMARK) return;
+
+    pmem_shrink(PMEM_HIGH_WATERMARK - pmem_free_blocks);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Writes the shrinker statistics to debug.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_shrink_print_stats(void) {
+
+    dbg_info("pmem: %u pages free (low watermark %u)\n", pmem_free_blocks, PMEM_LOW_WATERMARK);
+
+    for (u64 i = 0; i < pmem_shrinkers_count; i++) {
+
+        dbg_info("pmem shrinker %s: %u calls, %u pages freed\n",
+                pmem_shrinkers[i].name, pmem_shrinkers[i].calls, pmem_shrinkers[i].freed);
+    }
+}
@@ -0,0 +1,243 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Accounting of the Physical Memory Manager.
+///
+/// Keeps the number of pages allocated by each caller of pmem_alloc* (identified by its return
+/// address) and collects usage and fragmentation figures from the bitmap.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <types.h>
+#include <paging.h>
+#include <bootinfo.h>
+#include <isr.h>
+#include <pmem.h>
+#include <pmem_stats.h>
+#include <vmem.h>
+#include <vma.h>
+#include <utils.h>
+#include <dbg.h>
+
+
+/// @brief  The callers of pmem_alloc* (index 0 is unused, see PMEM_TAG_NONE).
+pmem_tag_t pmem_tags[PMEM_STATS_TAGS];
+/// @brief  The number of used entries in pmem_tags.
+u64 pmem_tags_count = 1;
+
+/// @brief  The tag of each allocated region (stored at its first block).
+u8 *pmem_block_tags = 0;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Initializes the accounting of the Physical Memory Manager.
+///
+/// Allocations made before are counted in blocks_allocated but not attributed to a caller.
+///
+/// @warning    Has to be called after vmem_init.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_stats_init(void) {
+
+    u64 pages = page_round_up(bitmap_bit_size);
+    u8 *tags = (u8*)P2V(pmem_alloc(pages, PMEM_ZONE_ANY));
+
+    mem_set(tags, PMEM_TAG_NONE, pages * PAGE_SIZE);
+    mem_set((u8*)pmem_tags, 0, sizeof(pmem_tags));
+
+    pmem_block_tags = tags;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Accounts an allocation to its caller.
+///
+/// @param  caller  The return address of the pmem_alloc* call.
+/// @param  block   The first block of the allocated region.
+/// @param  size    The size of the region in pages.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_stats_alloc(u64 caller, u64 block, u64 size) {
+
+    if (!pmem_block_tags) return;
+
+    u64 tag;
+    for (tag = 1; tag < pmem_tags_count; tag++) {
+        if (pmem_tags[tag].caller == caller) break;
+    }
+
+    if (tag == pmem_tags_count) {
+        if (pmem_tags_count < PMEM_TAG_OTHER) pmem_tags[pmem_tags_count++].caller = caller;
+        else tag = PMEM_TAG_OTHER;
+    }
+
+    pmem_tags[tag].allocs++;
+    pmem_tags[tag].pages += size;
+    pmem_block_tags[block] = tag;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Accounts a free to the caller that allocated the region.
+///
+/// @param  block   The first block of the freed region.
+/// @param  size    The size of the region in pages.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_stats_free(u64 block, u64 size) {
+
+    if (!pmem_block_tags) return;
+
+    u8 tag = pmem_block_tags[block];
+    if (tag == PMEM_TAG_NONE) return;
+
+    pmem_tags[tag].frees++;
+    pmem_tags[tag].pages -= size;
+    pmem_block_tags[block] = PMEM_TAG_NONE;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Searches for the largest run of unused blocks inside a range.
+///
+/// @param  from    The first block of the range.
+/// @param  to      The end of the range (exclusive).
+/// @param  free    Set to the number of unused blocks in the range.
+///
+/// @returns    The size of the largest run in pages.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_stats_largest_run(u64 from, u64 to, u64 *free) {
+
+    u64 largest = 0;
+    u64 block = from;
+    u64 end;
+
+    *free = 0;
+    while ((block = pmem_next_free_block(block, to)) != (u64)-1) {
+
+        end = pmem_next_used_block(block, to);
+        if (end - block > largest) largest = end - block;
+        *free += end - block;
+        block = end;
+    }
+
+    return largest;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Collects the memory usage summary.
+///
+/// @param  info    The structure to fill.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_stats_collect(pmem_info_t *info) {
+
+    u64 free;
+    u64 start_block;
+    u64 end_block;
+
+    info->total_pages = 0;
+    info->free_pages = 0;
+    info->largest_free_run = 0;
+
+    // usable memory only (reserved regions and holes are not counted)
+    for (u64 i = 0; i < bootinfo->num_regions; i++) {
+
+        if (bootinfo->regions[i].type != FREE) continue;
+
+        start_block = page_round_up(bootinfo->regions[i].base);
+        end_block = page_round_down(bootinfo->regions[i].base + bootinfo->regions[i].length);
+        if (end_block > bitmap_bit_size) end_block = bitmap_bit_size;
+        if (start_block >= end_block) continue;
+
+        u64 largest = pmem_stats_largest_run(start_block, end_block, &free);
+        if (largest > info->largest_free_run) info->largest_free_run = largest;
+
+        info->total_pages += end_block - start_block;
+        info->free_pages += free;
+    }
+
+    info->used_pages = info->total_pages - info->free_pages;
+    info->allocated_pages = blocks_allocated;
+    info->frag_index = info->free_pages
+        ? (info->free_pages - info->largest_free_run) * 100 / info->free_pages
+        : 0;
+
+    for (u64 zone = 0; zone < MAX_ZONES; zone++)
+        info->zone_free_pages[zone] = pmem_zone_free_pages(&pmem_zones[zone]);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Writes the memory usage per region, zone and caller to debug.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_stats_print(void) {
+
+    pmem_info_t info;
+    pmem_stats_collect(&info);
+
+    dbg_info("pmem: %u pages, %u used, %u free, %u allocated\n",
+            info.total_pages, info.used_pages, info.free_pages, info.allocated_pages);
+    dbg_info("pmem: largest free run %u pages, fragmentation %u%%\n",
+            info.largest_free_run, info.frag_index);
+
+    u64 free;
+    u64 largest;
+    u64 start_block;
+    u64 end_block;
+
+    for (u64 i = 0; i < bootinfo->num_regions; i++) {
+
+        if (bootinfo->regions[i].type != FREE) continue;
+
+        start_block = page_round_up(bootinfo->regions[i].base);
+        end_block = page_round_down(bootinfo->regions[i].base + bootinfo->regions[i].length);
+        if (end_block > bitmap_bit_size) end_block = bitmap_bit_size;
+        if (start_block >= end_block) continue;
+
+        largest = pmem_stats_largest_run(start_block, end_block, &free);
+        dbg_info("pmem: region %x - %x: %u used, %u free, largest run %u\n",
+                start_block * PAGE_SIZE, end_block * PAGE_SIZE,
+                end_block - start_block - free, free, largest);
+    }
+
+    for (u64 zone = 0; zone < MAX_ZONES; zone++) {
+        dbg_info("pmem: zone %s: %u free\n",
+                pmem_zones[zone].name, info.zone_free_pages[zone]);
+    }
+
+    for (u64 tag = 1; tag < PMEM_STATS_TAGS; tag++) {
+
+        if (!pmem_tags[tag].allocs) continue;
+        dbg_info("pmem: caller %x: %u pages in use, %u allocs, %u frees\n",
+                pmem_tags[tag].caller, pmem_tags[tag].pages,
+                pmem_tags[tag].allocs, pmem_tags[tag].frees);
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  System call returning the memory usage summary.
+///
+/// @param  args    A pointer to the current trapframe.
+///
+/// rdi: user pointer to a pmem_info_t. rax: 0 on success, -1 if the pointer is invalid (outside
+/// user space or not writable, see vma_user_writable).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void sys_meminfo(int_args_t *args) {
+
+    u64 addr = args->general_regs.rdi;
+
+    // the structure has to be in user space and writable by the process
+    if (addr + sizeof(pmem_info_t) < addr ||
+        addr + sizeof(pmem_info_t) > bootinfo->kernel_map.virt ||
+        !vma_user_writable(addr, sizeof(pmem_info_t))) {
+        args->general_regs.rax = -1;
+        return;
+    }
+
+    pmem_stats_collect((pmem_info_t*)addr);
+    args->general_regs.rax = 0;
+}
@@ -0,0 +1,128 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Pool of pre-zeroed page frames for pmem_alloc_clean.
+///
+/// The pool is filled from the idle loop, so clean single page allocations (page tables, 
+/// kernel stacks) don't have to zero a page while the caller waits.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <types.h>
+#include <paging.h>
+#include <pmem.h>
+#include <pmem_zero.h>
+#include <pmem_shrink.h>
+#include <vmem.h>
+#include <utils.h>
+#include <tty.h>
+#include <x86.h>
+#include <dbg.h>
+
+
+/// @brief  The pre-zeroed page frame pool.
+pmem_zero_pool_t pmem_zero_pool;
+
+/// @brief  Set once the pool may be used.
+bool pmem_zero_enabled = false;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Initializes the pre-zeroed page frame pool.
+///
+/// @warning    Has to be called after vmem_init. The pool is filled by pmem_zero_idle.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_zero_init(void) {
+
+    pmem_zero_pool.count = 0;
+    pmem_zero_pool.hits = 0;
+    pmem_zero_pool.fallbacks = 0;
+    pmem_zero_pool.zeroed = 0;
+    pmem_zero_enabled = true;
+
+    pmem_shrinker_register("zero pool", pmem_zero_shrink);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Zeroes a batch of page frames and puts them into the pool.
+///
+/// Called whenever the CPU has nothing else to do.
+/// Does at most PMEM_ZERO_BATCH pages per call to keep the latency of the idle loop low.
+/// Nothing is added while the free memory is below the low watermark.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_zero_idle(void) {
+
+    u64 block;
+
+    if (!pmem_zero_enabled || pmem_free_blocks < PMEM_LOW_WATERMARK) return;
+
+    for (u64 i = 0; i < PMEM_ZERO_BATCH; i++) {
+
+        if (pmem_zero_pool.count == PMEM_ZERO_POOL_SIZE) return;
+
+        block = pmem_reserve(1, PMEM_ZONE_ANY);
+        if (block == (u64)-1) return;
+
+        mem_zero_pages((u8*)P2V(block * PAGE_SIZE), 1);
+
+        pmem_zero_pool.blocks[pmem_zero_pool.count++] = block;
+        pmem_zero_pool.zeroed++;
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Takes a zero-initialized page frame out of the pool.
+///
+/// @returns    The block number of the page frame or -1 if the pool is empty.
+///
+/// The page frame is accessible at its P2V address through the direct map.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_zero_take(void) {
+
+    if (!pmem_zero_enabled) return -1;
+
+    if (pmem_zero_pool.count == 0) return -1;
+
+    pmem_zero_pool.hits++;
+    return pmem_zero_pool.blocks[--pmem_zero_pool.count];
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Gives pooled page frames back to the backend (shrinker).
+///
+/// @param  pages   How many page frames to release.
+///
+/// @returns    The number of page frames released.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 pmem_zero_shrink(u64 pages) {
+
+    u64 block;
+    u64 freed = 0;
+
+    while (freed < pages && pmem_zero_pool.count) {
+
+        block = pmem_zero_pool.blocks[--pmem_zero_pool.count];
+
+        pmem_release_direct(block, 1);
+        freed++;
+    }
+
+    return freed;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Writes the pool statistics to debug.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void pmem_zero_print_stats(void) {
+
+    dbg_info("pmem zero pool: depth %u/%u, %u served, %u synchronous fallbacks, %u zeroed\n",
+            pmem_zero_pool.count, PMEM_ZERO_POOL_SIZE, 
+            pmem_zero_pool.hits, pmem_zero_pool.fallbacks, pmem_zero_pool.zeroed);
+}
@@ -17,6 +17,7 @@
 #include <x86.h>
 #include <pmem.h>
 #include <vmem.h>
+#include <vma.h>
 #include <gdt.h>
 
 
@@ -31,13 +32,38 @@ pcb_t *last_proc;
 /// @brief  PCB of the kernel (used for memory mapping).
 pcb_t kernel_proc;
 
+/// @brief  Object cache for PCBs.
+slab_allocator_t pcb_cache;
+/// @brief  Statistics of the PCB cache (only used when built with -DALLOC_STATS, enabled by kmain
+///         once the memory managers are up).
+alloc_stats_t pcb_cache_stats;
+
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-/// Initializes the cur_proc var.
+/// Initializes the cur_proc var, the PCB cache and the virtual memory area cache.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 void proc_init(void) {
     cur_proc = &kernel_proc;
+
+    pcb_cache = CREATE_SLAB_ALLOCATOR("pcb", sizeof(pcb_t), _Alignof(pcb_t), proc_pcb_ctor);
+    pcb_cache.allocator.init(&pcb_cache);
+
+    vma_init();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Constructor of the PCB cache objects.
+///
+/// @param  obj     The PCB to construct.
+///
+/// proc_create relies on a zero-initialized PCB (name termination, list links).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void proc_pcb_ctor(void *obj) {
+
+    mem_set((u8*)obj, 0, sizeof(pcb_t));
 }
 
 
@@ -68,15 +94,20 @@ pcb_t *proc_create(allocator_t *allocator, pcb_t *parent, const char *name, u8 l
     proc->file = f;
 
     proc->pt4 = (pt_t)vmem_create_address_space();
+    proc->vmas = 0;
+
+    // the first page of the stack, it grows on demand
+    vma_add(&proc->vmas, USER_STACK_TOP - PAGE_SIZE, USER_STACK_TOP,
+            PAGE_USER | PAGE_WRITE, VMA_STACK);
 
 
     // todo: proper trapframe filling
-    proc->kstack = P2V(pmem_alloc_clean(proc->pt4, 1));
+    proc->kstack = P2V(pmem_alloc_clean(1, PMEM_ZONE_ANY));
     proc->ctx = (int_args_t*)proc->kstack;
     proc->ctx->cs = USER_CODE | PL_USER;
     proc->ctx->ds = USER_DATA | PL_USER;
     proc->ctx->rip = elf->code_entry;
-    proc->ctx->rsp = 0x401000;
+    proc->ctx->rsp = USER_STACK_TOP;
     proc->ctx->flags = 0;
     proc->ctx->int_vec = 0;
     proc->ctx->err_code = 0;
@@ -115,8 +146,66 @@ pcb_t *proc_create(allocator_t *allocator, pcb_t *parent, const char *name, u8 l
 }
 
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Creates a copy of a process (fork).
+///
+/// @param  allocator   The allocator to use for allocating the PCB.
+/// @param  parent      A pointer to the PCB of the process to copy.
+/// @param  ctx         The trapframe of the parent to continue from.
+///
+/// @returns    A pointer to the PCB of the child.
+///
+/// The address space is cloned copy-on-write, so no page is copied until one of the processes
+/// writes to it. The child continues with the same registers, but rax = 0.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+pcb_t *proc_fork(allocator_t *allocator, pcb_t *parent, int_args_t *ctx) {
+
+    if (!parent->pt4) panic("Cannot fork the kernel");
+
+    pcb_t *proc = (pcb_t*)allocator->alloc(allocator, sizeof(pcb_t));
+    mem_cpy((u8*)proc->name, (u8*)parent->name, MAX_NAME);
+    proc->file = parent->file;
+
+    proc->pt4 = (pt_t)vmem_clone_address_space(parent->pt4);
+    proc->vmas = vma_clone(parent->vmas);
+
+    proc->kstack = P2V(pmem_alloc_clean(1, PMEM_ZONE_ANY));
+    proc->ctx = (int_args_t*)proc->kstack;
+    mem_cpy((u8*)proc->ctx, (u8*)ctx, sizeof(int_args_t));
+    proc->ctx->general_regs.rax = 0;
+
+    proc->pid = ++last_pid;
+    proc->state = RUNNABLE;
+    proc->cpu_ms = 0;
+    proc->parent = parent;
+
+    proc->prev = last_proc;
+    if (last_proc != 0)
+        last_proc->next = proc;
+    last_proc = proc;
+
+    return proc;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  System call: creates a copy of the calling process.
+///
+/// @param  args    A pointer to the trapframe.
+///
+/// Returns the PID of the child to the parent (rax), the child gets 0.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void sys_fork(int_args_t *args) {
+
+    args->general_regs.rax = proc_fork((allocator_t*)&pcb_cache, cur_proc, args)->pid;
+}
+
+
 void switch_ctx(pcb_t *new) {
 
+    cur_proc = new;
     x86_load_pt4((pt_t)V2P(new->pt4));
     x86_change_kstack(new->kstack);
 
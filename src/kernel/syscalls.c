@@ -10,10 +10,14 @@
 #include <x86.h>
 #include <tty.h>
 #include <proc.h>
+#include <pmem_stats.h>
+#include <arena.h>
 
 
 /// @brief  Array of handlers for each syscall.
 isr_t syscalls[MAX_SYSCALL];
+/// @brief  The number of registered system calls.
+u64 syscalls_count = 0;
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -21,21 +25,27 @@ isr_t syscalls[MAX_SYSCALL];
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 void syscall_init(void) {
-     
+
+    syscall_add(sys_meminfo);
+    syscall_add(sys_fork);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 /// @brief  Handles system calls.
 ///
 /// @param  args    A pointer to the current trapframe.
+///
+/// Everything a handler allocates from the scratch arena is freed when it returns.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 void syscall_handler(int_args_t *args) {
 
-    if (args->general_regs.rax >= MAX_SYSCALL)
+    if (args->general_regs.rax >= syscalls_count)
             panic("Illegal syscall number");
 
+    arena_mark_t mark = arena_mark(scratch_arena());
     syscalls[args->general_regs.rax](args);
+    arena_rewind(scratch_arena(), mark);
 }
 
 
@@ -43,8 +53,13 @@ void syscall_handler(int_args_t *args) {
 /// @brief  Registers a new system call.
 ///
 /// @param  func    The function pointer of the system call handler.
+///
+/// System calls are numbered in the order they are registered.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 void syscall_add(isr_t func) {
 
+    if (syscalls_count >= MAX_SYSCALL) panic("Too many syscalls");
+
+    syscalls[syscalls_count++] = func;
 }
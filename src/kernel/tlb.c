@@ -0,0 +1,259 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Contains functions for invalidating TLB entries after page table changes.
+///
+/// Unmapped pages are collected in a tlb_gather_t and invalidated at once: up to
+/// TLB_FLUSH_THRESHOLD pages with invlpg, more with a full flush (cheaper than hundreds of
+/// invlpg and the refill costs about the same). Page tables freed during the unmap are only
+/// handed back after the flush, because the CPU may still walk them through its caches.
+///
+/// Other CPUs are asked to invalidate the same batch with an IPI (shootdown) and the caller waits
+/// until all of them are done, so the frames can be reused afterwards.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <types.h>
+#include <paging.h>
+#include <cpu.h>
+#include <tlb.h>
+#include <pmem.h>
+#include <vmem.h>
+#include <err.h>
+#include <tty.h>
+#include <x86.h>
+#include <dbg.h>
+
+
+/// @brief  Pending shootdown request of each CPU.
+tlb_shootdown_t tlb_shootdowns[MAX_CPUS];
+/// @brief  Bit set for every CPU taking part in shootdowns (only the bootstrap processor yet).
+u64 tlb_cpus = 1;
+
+/// @brief  Pages invalidated with invlpg.
+u64 tlb_page_flushes = 0;
+/// @brief  Full TLB flushes.
+u64 tlb_full_flushes = 0;
+/// @brief  Shootdown IPIs sent.
+u64 tlb_ipis = 0;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Starts an empty batch.
+///
+/// @param  gather  The batch.
+/// @param  pt4     A pointer to the 4th level page table the pages are unmapped from.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void tlb_gather_init(tlb_gather_t *gather, pt_t pt4) {
+
+    gather->pt4 = pt4;
+    gather->count = 0;
+    gather->tables = 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Adds an unmapped page to a batch.
+///
+/// @param  gather  The batch.
+/// @param  vaddr   A virtual address inside the page.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void tlb_gather_add(tlb_gather_t *gather, u64 vaddr) {
+
+    if (gather->count < TLB_FLUSH_THRESHOLD) gather->vaddrs[gather->count] = vaddr;
+    gather->count++;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Adds an unlinked page table to a batch (freed by tlb_gather_flush).
+///
+/// @param  gather  The batch.
+/// @param  paddr   The physical address of the page table.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void tlb_gather_free_table(tlb_gather_t *gather, u64 paddr) {
+
+    *(u64*)P2V(paddr) = gather->tables;
+    gather->tables = paddr;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Invalidates the pages of a batch on all CPUs and frees its page tables.
+///
+/// @param  gather  The batch (empty afterwards).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void tlb_gather_flush(tlb_gather_t *gather) {
+
+    u64 table;
+
+    if (gather->count) {
+        tlb_invalidate(gather);
+        tlb_shootdown(gather);
+    }
+
+    while (gather->tables) {
+        table = gather->tables;
+        gather->tables = *(u64*)P2V(table);
+        pmem_free(table, 1);
+    }
+
+    gather->count = 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Invalidates a single page on all CPUs.
+///
+/// @param  pt4     A pointer to the 4th level page table the page was changed in.
+/// @param  vaddr   The virtual address of the page.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void tlb_flush_page(pt_t pt4, u64 vaddr) {
+
+    tlb_gather_t gather;
+
+    tlb_gather_init(&gather, pt4);
+    tlb_gather_add(&gather, vaddr);
+    tlb_gather_flush(&gather);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Invalidates all pages of an address space on all CPUs.
+///
+/// @param  pt4     A pointer to the 4th level page table.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void tlb_flush_all(pt_t pt4) {
+
+    tlb_gather_t gather;
+
+    tlb_gather_init(&gather, pt4);
+    gather.count = TLB_FLUSH_THRESHOLD + 1;
+    tlb_gather_flush(&gather);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Checks if the executing CPU may cache translations of an address space.
+///
+/// @param  pt4     A pointer to the 4th level page table.
+///
+/// @returns    True for the loaded address space and the kernel (shared by all address spaces).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool tlb_is_active(pt_t pt4) {
+
+    return pt4 == kernel_pt4 || V2P((u64)pt4) == x86_read_cr3();
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Invalidates the pages of a batch on the executing CPU.
+///
+/// @param  gather  The batch.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void tlb_invalidate(tlb_gather_t *gather) {
+
+    if (!tlb_is_active(gather->pt4)) return;
+
+    if (gather->count > TLB_FLUSH_THRESHOLD) {
+        // kernel pages are global
+        x86_flush_tlb_global();
+        __atomic_add_fetch(&tlb_full_flushes, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    for (u64 i = 0; i < gather->count; i++) x86_invlpg(gather->vaddrs[i]);
+    __atomic_add_fetch(&tlb_page_flushes, gather->count, __ATOMIC_RELAXED);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Makes the other CPUs invalidate the pages of a batch.
+///
+/// @param  gather  The batch.
+///
+/// Returns after every CPU has processed the request. Requests posted to the executing CPU in
+/// the meantime are processed while waiting, so two CPUs shooting at each other cannot deadlock.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void tlb_shootdown(tlb_gather_t *gather) {
+
+    u64 self = cpu_id();
+    tlb_gather_t *expected;
+
+    for (u64 cpu = 0; cpu < MAX_CPUS; cpu++) {
+
+        if (cpu == self || !(tlb_cpus & (1ull << cpu))) continue;
+
+        for (;;) {
+            expected = 0;
+            if (__atomic_compare_exchange_n(&tlb_shootdowns[cpu].gather, &expected, gather,
+                        false, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                break;
+
+            tlb_shootdown_handler();
+            x86_pause();
+        }
+
+        tlb_send_ipi(cpu);
+    }
+
+    for (u64 cpu = 0; cpu < MAX_CPUS; cpu++) {
+
+        if (cpu == self || !(tlb_cpus & (1ull << cpu))) continue;
+
+        while (__atomic_load_n(&tlb_shootdowns[cpu].gather, __ATOMIC_ACQUIRE) == gather) {
+            tlb_shootdown_handler();
+            x86_pause();
+        }
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Processes the shootdown request posted to the executing CPU (IPI handler).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void tlb_shootdown_handler(void) {
+
+    tlb_shootdown_t *request = &tlb_shootdowns[cpu_id()];
+    tlb_gather_t *gather = __atomic_load_n(&request->gather, __ATOMIC_ACQUIRE);
+
+    if (!gather) return;
+
+    tlb_invalidate(gather);
+    __atomic_store_n(&request->gather, 0, __ATOMIC_RELEASE);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Interrupts a CPU to process its shootdown request.
+///
+/// @param  cpu     The index of the CPU.
+///
+/// @warning    There is no local APIC driver yet, so no CPU besides the bootstrap processor may
+///             be added to tlb_cpus.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void tlb_send_ipi(u64 cpu) {
+
+    tlb_ipis++;
+    panic("Cannot send a TLB shootdown IPI to CPU %u without a local APIC\n", cpu);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Writes the TLB invalidation counters to debug.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void tlb_print_stats(void) {
+
+    dbg_info("tlb: %u pages invalidated, %u full flushes, %u shootdown IPIs\n",
+            tlb_page_flushes, tlb_full_flushes, tlb_ipis);
+}
@@ -4,6 +4,8 @@
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 #include <types.h>
+#include <paging.h>
+#include <x86.h>
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -12,13 +14,13 @@
 /// @param  dest    Destination address.
 /// @param  val     The value to write.
 /// @param  n_bytes How many bytes to write.
+///
+/// Uses rep stosb, which writes whole cache lines at once on CPUs with fast string operations.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 void mem_set(u8 *dest, u8 val, u64 n_bytes) {
 
-    for (u64 i = 0; i < n_bytes; i++) {
-        *(dest + i) = val;
-    }
+    ASM("rep stosb" : "+D" (dest), "+c" (n_bytes) : "a" (val) : "memory");
 }
 
 
@@ -36,3 +38,19 @@ void mem_cpy(u8 *dest, u8 *src, u64 n_bytes) {
           *(dest + i) = *(src + i);
      }
 }
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Zero-initializes whole pages.
+///
+/// @param  dest    Destination address (page aligned).
+/// @param  pages   How many pages to zero.
+///
+/// Writes 8 bytes per iteration using rep stosq.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void mem_zero_pages(u8 *dest, u64 pages) {
+
+    u64 count = pages * PAGE_SIZE / sizeof(u64);
+    ASM("rep stosq" : "+D" (dest), "+c" (count) : "a" (0) : "memory");
+}
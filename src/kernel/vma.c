@@ -0,0 +1,258 @@
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @file
+/// @brief  Contains functions for the virtual memory areas of user address spaces.
+///
+/// Processes describe their memory as a sorted list of areas instead of mapping it up front.
+/// The first access to a page raises a page fault, vma_fault allocates and fills a frame for it
+/// and the instruction is repeated. Pages that are never touched cost nothing.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#include <types.h>
+#include <paging.h>
+#include <isr.h>
+#include <vma.h>
+#include <proc.h>
+#include <pmem.h>
+#include <vmem.h>
+#include <slab.h>
+#include <utils.h>
+#include <err.h>
+#include <tty.h>
+#include <x86.h>
+#include <dbg.h>
+
+
+/// @brief  Object cache for virtual memory areas.
+slab_allocator_t vma_cache;
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Initializes the virtual memory area cache.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void vma_init(void) {
+
+    vma_cache = CREATE_SLAB_ALLOCATOR("vma", sizeof(vma_t), _Alignof(vma_t), 0);
+    vma_cache.allocator.init(&vma_cache);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Adds a virtual memory area to the list of a process.
+///
+/// @param  vmas    A pointer to the head of the list (sorted by address).
+/// @param  start   The start address (rounded down to a page).
+/// @param  end     The end address (rounded up to a page).
+/// @param  flags   Attributes for the mapped pages.
+/// @param  type    How the pages are filled.
+///
+/// @returns    A pointer to the new area (data and data_size have to be set for VMA_FILE).
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+vma_t *vma_add(vma_t **vmas, u64 start, u64 end, u64 flags, vma_type_t type) {
+
+    start = page_base(start);
+    end = page_round_up(end) * PAGE_SIZE;
+
+    while (*vmas && (*vmas)->end <= start) vmas = &(*vmas)->next;
+
+    if (*vmas && (*vmas)->start < end)
+        panic("Virtual memory area %x - %x overlaps %x - %x\n",
+                start, end, (*vmas)->start, (*vmas)->end);
+
+    vma_t *vma = (vma_t*)vma_cache.allocator.alloc(&vma_cache, sizeof(vma_t));
+    vma->next = *vmas;
+    vma->start = start;
+    vma->end = end;
+    vma->flags = flags;
+    vma->type = type;
+    vma->data = 0;
+    vma->data_size = 0;
+    vma->faults = 0;
+
+    *vmas = vma;
+    return vma;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Copies the virtual memory areas of a process (fork).
+///
+/// @param  vmas    The list of areas.
+///
+/// @returns    The head of the copied list.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+vma_t *vma_clone(vma_t *vmas) {
+
+    vma_t *head = 0;
+    vma_t **tail = &head;
+
+    for (; vmas; vmas = vmas->next) {
+
+        *tail = (vma_t*)vma_cache.allocator.alloc(&vma_cache, sizeof(vma_t));
+        mem_cpy((u8*)*tail, (u8*)vmas, sizeof(vma_t));
+        (*tail)->faults = 0;
+        tail = &(*tail)->next;
+    }
+
+    *tail = 0;
+    return head;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Looks up the virtual memory area containing an address.
+///
+/// @param  vmas    The list of areas.
+/// @param  vaddr   The virtual address.
+///
+/// @returns    A pointer to the area or 0 if the address is not part of any area.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+vma_t *vma_find(vma_t *vmas, u64 vaddr) {
+
+    for (; vmas && vmas->start <= vaddr; vmas = vmas->next) {
+        if (vaddr < vmas->end) return vmas;
+    }
+
+    return 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Grows a stack area down to an address.
+///
+/// @param  vmas    The list of areas.
+/// @param  vaddr   The faulting virtual address below the stack.
+///
+/// @returns    A pointer to the grown area or 0 if no stack can grow to the address.
+///
+/// A stack grows up to USER_STACK_MAX bytes as long as it does not reach the area below it.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+vma_t *vma_grow_stack(vma_t *vmas, u64 vaddr) {
+
+    vma_t *prev = 0;
+
+    for (; vmas && vmas->end <= vaddr; vmas = vmas->next) prev = vmas;
+
+    if (!vmas || vmas->type != VMA_STACK || vaddr + USER_STACK_MAX < vmas->end) return 0;
+    if (prev && prev->end > page_base(vaddr)) return 0;
+
+    vmas->start = page_base(vaddr);
+    return vmas;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Resolves a page fault of the current process.
+///
+/// @param  args    A pointer to the trapframe of the page fault.
+///
+/// @returns    True if a page was mapped (or copied, see vmem_cow_fault) and the access can be
+///             repeated, False if the fault is an error.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool vma_fault(int_args_t *args) {
+
+    u64 vaddr = args->control_regs.cr2;
+
+    if (!cur_proc->pt4) return false;
+
+    // the only protection violations resolved are writes to copy-on-write pages
+    if (args->err_code & PF_PRESENT)
+        return (args->err_code & PF_WRITE) && vmem_cow_fault(cur_proc->pt4, vaddr);
+
+    vma_t *vma = vma_find(cur_proc->vmas, vaddr);
+    if (!vma) vma = vma_grow_stack(cur_proc->vmas, vaddr);
+    if (!vma) return false;
+
+    if ((args->err_code & PF_WRITE) && !GET_FLAG(vma->flags, PAGE_WRITE)) return false;
+
+    u64 page = page_base(vaddr);
+    vmem_map(cur_proc->pt4, page, vma_load_page(vma, page), vma->flags);
+    vma->faults++;
+
+    return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Checks if the kernel may write to a user buffer of the current process.
+///
+/// @param  vaddr   The start address of the buffer.
+/// @param  size    The size of the buffer in bytes.
+///
+/// @returns    True if every page is mapped user writable or belongs to a user writable area
+///             (mapped or copied by vma_fault on the write), False otherwise.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool vma_user_writable(u64 vaddr, u64 size) {
+
+    u64 flags = PAGE_USER | PAGE_WRITE;
+    pte_t *pte;
+    vma_t *vma;
+
+    if (!cur_proc->pt4 || !size || vaddr + size < vaddr) return false;
+
+    for (u64 page = page_base(vaddr); page < vaddr + size; page += PAGE_SIZE) {
+
+        pte = vmem_get_pte(cur_proc->pt4, page);
+
+        if (pte && GET_FLAG(*pte, PAGE_PRESENT)) {
+            if ((*pte & flags) == flags) continue;
+            // read-only pages are only written to after a copy-on-write fault
+            if (!GET_FLAG(*pte, PAGE_USER) || !GET_FLAG(*pte, PAGE_COW)) return false;
+        }
+
+        vma = vma_find(cur_proc->vmas, page);
+        if (!vma || (vma->flags & flags) != flags) return false;
+    }
+
+    return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Allocates and fills the page frame for a page of a virtual memory area.
+///
+/// @param  vma     The area.
+/// @param  page    The virtual address of the page.
+///
+/// @returns    The physical address of the page frame.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 vma_load_page(vma_t *vma, u64 page) {
+
+    u64 off = page - vma->start;
+
+    if (vma->type != VMA_FILE || off >= vma->data_size)
+        return pmem_alloc_clean(1, PMEM_ZONE_ANY);
+
+    u64 paddr = pmem_alloc(1, PMEM_ZONE_ANY);
+    u64 size = vma->data_size - off < PAGE_SIZE ? vma->data_size - off : PAGE_SIZE;
+
+    mem_cpy((u8*)P2V(paddr), vma->data + off, size);
+    mem_set((u8*)P2V(paddr) + size, 0, PAGE_SIZE - size);
+
+    return paddr;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Writes the virtual memory areas of a process to debug.
+///
+/// @param  vmas    The list of areas.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void vma_print(vma_t *vmas) {
+
+    const char *types[] = {"anon", "file", "stack"};
+
+    for (; vmas; vmas = vmas->next) {
+        dbg_info("vma %x - %x %s: %u of %u pages mapped\n",
+                vmas->start, vmas->end, types[vmas->type],
+                vmas->faults, (vmas->end - vmas->start) / PAGE_SIZE);
+    }
+}
@@ -8,16 +8,27 @@
 #include <types.h>
 #include <vmem.h>
 #include <pmem.h>
+#include <pmem_ref.h>
+#include <tlb.h>
 #include <paging.h>
 #include <x86.h>
 #include <utils.h>
 #include <err.h>
 #include <tty.h>
 #include <proc.h>
+#include <dbg.h>
 
 
 /// @brief  The 4th level page table of the kernel.
 pt_t kernel_pt4;
+/// @brief  The end of the kernel map 3rd level page table entries (shared by all address spaces).
+u64 kernel_pt3_end;
+/// @brief  Start of the virtual range reserved for the kernel heap (right after the kernel map).
+u64 kernel_heap_base;
+/// @brief  Number of 4 KiB, 2 MiB and 1 GiB pages the direct map was built with.
+u64 vmem_direct_pages[3];
+/// @brief  True if the CPU supports 1 GiB pages.
+bool vmem_1g_pages;
 
 /// @brief  Memory range of the VGA area.
 const range_t vga_range = {0xa0000, 0xbffff};
@@ -51,21 +62,24 @@ void vmem_map_raw(pt_t pt4, u64 vaddr, u64 paddr, u64 flags) {
     pt4_entry = &pt4[INDEX_PT4(vaddr)];
     // create a new page table if not present
     if (!GET_FLAG(*pt4_entry, PAGE_PRESENT)) 
-        *pt4_entry = pmem_alloc_raw(1) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+        *pt4_entry = pmem_alloc_raw(1, PMEM_ZONE_ANY) | 
+            PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
 
     pt3 = (pt_t)P2V(ADDRESS(*pt4_entry));
 
     pt3_entry = &pt3[INDEX_PT3(vaddr)];
     // create a new page table if not present
     if (!GET_FLAG(*pt3_entry, PAGE_PRESENT)) 
-        *pt3_entry = pmem_alloc_raw(1) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+        *pt3_entry = pmem_alloc_raw(1, PMEM_ZONE_ANY) | 
+            PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
 
     pt2 = (pt_t)P2V(ADDRESS(*pt3_entry));
 
     pt2_entry = &pt2[INDEX_PT2(vaddr)];
     // create a new page table if not present
     if (!GET_FLAG(*pt2_entry, PAGE_PRESENT)) 
-        *pt2_entry = pmem_alloc_raw(1) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+        *pt2_entry = pmem_alloc_raw(1, PMEM_ZONE_ANY) | 
+            PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
 
     pt1 = (pt_t)P2V(ADDRESS(*pt2_entry));
 
@@ -104,36 +118,120 @@ void vmem_map(pt_t pt4, u64 vaddr, u64 paddr, u64 flags) {
     pt4_entry = &pt4[INDEX_PT4(vaddr)];
     // create a new page table if not present
     if (!GET_FLAG(*pt4_entry, PAGE_PRESENT)) 
-        *pt4_entry = pmem_alloc_clean(pt4, 1) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+        *pt4_entry = pmem_alloc_clean(1, PMEM_ZONE_ANY) |
+            PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
 
     pt3 = (pt_t)P2V(ADDRESS(*pt4_entry));
 
     pt3_entry = &pt3[INDEX_PT3(vaddr)];
     // create a new page table if not present
     if (!GET_FLAG(*pt3_entry, PAGE_PRESENT)) 
-        *pt3_entry = pmem_alloc_clean(pt4, 1) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+        *pt3_entry = pmem_alloc_clean(1, PMEM_ZONE_ANY) |
+            PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+    else if (GET_FLAG(*pt3_entry, PAGE_HUGE)) goto mapped;
 
     pt2 = (pt_t)P2V(ADDRESS(*pt3_entry));
 
     pt2_entry = &pt2[INDEX_PT2(vaddr)];
     // create a new page table if not present
     if (!GET_FLAG(*pt2_entry, PAGE_PRESENT)) 
-        *pt2_entry = pmem_alloc_clean(pt4, 1) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+        *pt2_entry = pmem_alloc_clean(1, PMEM_ZONE_ANY) |
+            PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+    else if (GET_FLAG(*pt2_entry, PAGE_HUGE)) goto mapped;
 
     pt1 = (pt_t)P2V(ADDRESS(*pt2_entry));
 
     // check if mapping already exists
 
     pt1_entry = &pt1[INDEX_PT1(vaddr)];
-    if (GET_FLAG(*pt1_entry, PAGE_PRESENT)) 
-        panic("Virtual address already allocated: %x\n", vaddr);
+    if (GET_FLAG(*pt1_entry, PAGE_PRESENT)) goto mapped;
 
     pt1[INDEX_PT1(vaddr)] = paddr | flags | PAGE_PRESENT;
+    return;
+
+mapped:
+    panic("Virtual address already allocated: %x\n", vaddr);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Maps a single 2 MiB or 1 GiB page.
+///
+/// @param  pt4         A pointer to the 4th level page table to use.
+/// @param  vaddr       The virtual address to map the page to (aligned to page_size).
+/// @param  paddr       The physical address to map (aligned to page_size).
+/// @param  flags       Attributes for the mapped page.
+/// @param  page_size   PAGE_SIZE_2M or PAGE_SIZE_1G.
+///
+/// @warning    Only used for bootstrapping the initial kernel page table as it does only work with
+///             the 1 GB identity mapped bootloader page table.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void vmem_map_huge_raw(pt_t pt4, u64 vaddr, u64 paddr, u64 flags, u64 page_size) {
+
+    pte_t *entry = &pt4[INDEX_PT4(vaddr)];
+    if (!GET_FLAG(*entry, PAGE_PRESENT)) 
+        *entry = pmem_alloc_raw(1, PMEM_ZONE_ANY) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+
+    entry = &((pt_t)P2V(ADDRESS(*entry)))[INDEX_PT3(vaddr)];
+
+    if (page_size == PAGE_SIZE_2M) {
+
+        if (!GET_FLAG(*entry, PAGE_PRESENT)) 
+            *entry = pmem_alloc_raw(1, PMEM_ZONE_ANY) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+
+        entry = &((pt_t)P2V(ADDRESS(*entry)))[INDEX_PT2(vaddr)];
+    }
+
+    if (GET_FLAG(*entry, PAGE_PRESENT)) 
+        panic("Virtual address already allocated: %x\n", vaddr);
+
+    *entry = paddr | flags | PAGE_HUGE | PAGE_PRESENT;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Maps a physical memory region into the direct map (P2V) with the largest pages.
+///
+/// @param  pt4     A pointer to the 4th level page table to use.
+/// @param  base    The physical address of the region (page aligned).
+/// @param  end     The physical end address of the region (page aligned).
+///
+/// 1 GiB pages are used if the CPU supports them (vmem_1g_pages), 2 MiB pages otherwise. The
+/// unaligned head and tail of the region get 4 KiB pages.
+///
+/// @warning    Only used for bootstrapping the initial kernel page table as it does only work with
+///             the 1 GB identity mapped bootloader page table.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void vmem_map_direct(pt_t pt4, u64 base, u64 end) {
+
+    u64 flags = PAGE_WRITE | PAGE_GLOBAL;
+
+    // pv_base is 1 GiB aligned, so physical and virtual alignment are the same
+    for (u64 paddr = base; paddr < end;) {
+
+        if (vmem_1g_pages && paddr % PAGE_SIZE_1G == 0 && end - paddr >= PAGE_SIZE_1G) {
+            vmem_map_huge_raw(pt4, P2V(paddr), paddr, flags, PAGE_SIZE_1G);
+            vmem_direct_pages[2]++;
+            paddr += PAGE_SIZE_1G;
+
+        } else if (paddr % PAGE_SIZE_2M == 0 && end - paddr >= PAGE_SIZE_2M) {
+            vmem_map_huge_raw(pt4, P2V(paddr), paddr, flags, PAGE_SIZE_2M);
+            vmem_direct_pages[1]++;
+            paddr += PAGE_SIZE_2M;
+
+        } else {
+            vmem_map_raw(pt4, P2V(paddr), paddr, flags);
+            vmem_direct_pages[0]++;
+            paddr += PAGE_SIZE;
+        }
+    }
 }
 
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
-/// @brief  Unmaps a single page.
+/// @brief  Unmaps a single page and invalidates its TLB entry.
 ///
 /// @param  pt4     A pointer to the 4th level page table to use.
 /// @param  vaddr   The virtual address of the page to unmap.
@@ -156,18 +254,100 @@ void vmem_unmap(pt_t pt4, u64 vaddr) {
     pt3 = (pt_t)P2V(ADDRESS(*pt4_entry));
     pt3_entry = &pt3[INDEX_PT3(vaddr)];
     if (!GET_FLAG(*pt3_entry, PAGE_PRESENT)) goto not_mapped;
+    if (GET_FLAG(*pt3_entry, PAGE_HUGE)) goto huge;
 
     pt2 = (pt_t)P2V(ADDRESS(*pt3_entry));
     pt2_entry = &pt2[INDEX_PT2(vaddr)];
     if (!GET_FLAG(*pt2_entry, PAGE_PRESENT)) goto not_mapped;
+    if (GET_FLAG(*pt2_entry, PAGE_HUGE)) goto huge;
 
     pt1 = (pt_t)P2V(ADDRESS(*pt2_entry));
     pt1_entry = &pt1[INDEX_PT1(vaddr)];
     if (!GET_FLAG(*pt1_entry, PAGE_PRESENT)) goto not_mapped;
 
     *pt1_entry = 0;
+    tlb_flush_page(pt4, vaddr);
     return;
 
+not_mapped:
+    panic("Virtual address has not been allocated yet: %x\n", vaddr);
+
+huge:
+    // the direct map is never split
+    panic("Cannot unmap a page of a huge page: %x\n", vaddr);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Looks up the page table entry of a virtual page.
+///
+/// @param  pt4     A pointer to the 4th level page table to use.
+/// @param  vaddr   The virtual address of the page.
+///
+/// @returns    A pointer to the 1st level page table entry (the 2nd or 3rd level entry for huge
+///             pages) or 0 if a page table is missing.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+pte_t *vmem_get_pte(pt_t pt4, u64 vaddr) {
+
+    pte_t entry = pt4[INDEX_PT4(vaddr)];
+    if (!GET_FLAG(entry, PAGE_PRESENT)) return 0;
+
+    pte_t *pt3_entry = &((pt_t)P2V(ADDRESS(entry)))[INDEX_PT3(vaddr)];
+    if (!GET_FLAG(*pt3_entry, PAGE_PRESENT)) return 0;
+    if (GET_FLAG(*pt3_entry, PAGE_HUGE)) return pt3_entry;
+
+    pte_t *pt2_entry = &((pt_t)P2V(ADDRESS(*pt3_entry)))[INDEX_PT2(vaddr)];
+    if (!GET_FLAG(*pt2_entry, PAGE_PRESENT)) return 0;
+    if (GET_FLAG(*pt2_entry, PAGE_HUGE)) return pt2_entry;
+
+    return &((pt_t)P2V(ADDRESS(*pt2_entry)))[INDEX_PT1(vaddr)];
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Checks if a virtual page is mapped.
+///
+/// @param  pt4     A pointer to the 4th level page table to use.
+/// @param  vaddr   The virtual address of the page.
+///
+/// @returns    True if the page is mapped, otherwise False.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool vmem_is_mapped(pt_t pt4, u64 vaddr) {
+
+    pte_t *pte = vmem_get_pte(pt4, vaddr);
+    return pte != 0 && GET_FLAG(*pte, PAGE_PRESENT);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Translates a virtual address to the physical address it is mapped to.
+///
+/// @param  pt4     A pointer to the 4th level page table to use.
+/// @param  vaddr   The virtual address.
+///
+/// @returns    The physical address.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 vmem_translate(pt_t pt4, u64 vaddr) {
+
+    pte_t entry = pt4[INDEX_PT4(vaddr)];
+    if (!GET_FLAG(entry, PAGE_PRESENT)) goto not_mapped;
+
+    entry = ((pt_t)P2V(ADDRESS(entry)))[INDEX_PT3(vaddr)];
+    if (!GET_FLAG(entry, PAGE_PRESENT)) goto not_mapped;
+    if (GET_FLAG(entry, PAGE_HUGE)) return ADDRESS(entry) + vaddr % PAGE_SIZE_1G;
+
+    entry = ((pt_t)P2V(ADDRESS(entry)))[INDEX_PT2(vaddr)];
+    if (!GET_FLAG(entry, PAGE_PRESENT)) goto not_mapped;
+    if (GET_FLAG(entry, PAGE_HUGE)) return ADDRESS(entry) + vaddr % PAGE_SIZE_2M;
+
+    entry = ((pt_t)P2V(ADDRESS(entry)))[INDEX_PT1(vaddr)];
+    if (!GET_FLAG(entry, PAGE_PRESENT)) goto not_mapped;
+
+    return ADDRESS(entry) + vaddr % PAGE_SIZE;
+
 not_mapped:
     panic("Virtual address has not been allocated yet: %x\n", vaddr);
 }
@@ -179,18 +359,164 @@ not_mapped:
 /// @param  pt4     A pointer to the 4th level page table to use.
 /// @param  vaddr   The virtual address to map the region to.
 /// @param  paddr   The physical address of the region to map.
-/// @param  flags   Attributes for the mapped region.
+/// @param  flags   Attributes for the mapped region (PAGE_HUGE allows huge pages).
 /// @param  blocks  The size of the region in pages.
+///
+/// Every page table on the way is looked up once and its entries are filled in a row. With
+/// PAGE_HUGE in flags, 2 MiB and 1 GiB pages are used wherever the virtual and the physical
+/// address are aligned, such regions can only be unmapped as a whole.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 void vmem_map_region(pt_t pt4, u64 vaddr, u64 paddr, u64 flags, u64 blocks) {
 
-    for (u64 block = 0; block < blocks; block++) {
-        vmem_map(pt4, vaddr + block * PAGE_SIZE, paddr + block * PAGE_SIZE, flags);
+    u64 end = vaddr + blocks * PAGE_SIZE;
+    // the distance stays the same for the whole region
+    u64 offset = paddr - vaddr;
+
+    while (vaddr < end) {
+        vaddr = vmem_map_pt3(
+                vmem_next_table(&pt4[INDEX_PT4(vaddr)], vaddr), vaddr, end, offset, flags);
     }
 }
 
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns the page table an entry points to and creates it if not present.
+///
+/// @param  entry   A pointer to the entry.
+/// @param  vaddr   The virtual address that is being mapped.
+///
+/// @returns    A pointer to the next level page table.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+pt_t vmem_next_table(pte_t *entry, u64 vaddr) {
+
+    if (!GET_FLAG(*entry, PAGE_PRESENT))
+        *entry = pmem_alloc_clean(1, PMEM_ZONE_ANY) |
+            PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+    else if (GET_FLAG(*entry, PAGE_HUGE))
+        panic("Virtual address already allocated: %x\n", vaddr);
+
+    return (pt_t)P2V(ADDRESS(*entry));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Checks if a part of a region can be mapped with a single huge page.
+///
+/// @param  entry       The 2nd or 3rd level page table entry for vaddr.
+/// @param  vaddr       The virtual address of the part.
+/// @param  end         The end of the region.
+/// @param  offset      The distance between the physical and the virtual address.
+/// @param  flags       Attributes for the mapped region.
+/// @param  page_size   PAGE_SIZE_2M or PAGE_SIZE_1G.
+///
+/// @returns    True if a huge page is allowed, aligned and fits into the region.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool vmem_can_promote(pte_t entry, u64 vaddr, u64 end, u64 offset, u64 flags, u64 page_size) {
+
+    return GET_FLAG(flags, PAGE_HUGE) &&
+        !GET_FLAG(entry, PAGE_PRESENT) &&
+        (vaddr | (vaddr + offset)) % page_size == 0 &&
+        end - vaddr >= page_size;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Maps the part of a region covered by a 3rd level page table.
+///
+/// @param  pt3     A pointer to the 3rd level page table.
+/// @param  vaddr   The virtual address to start at.
+/// @param  end     The end of the region.
+/// @param  offset  The distance between the physical and the virtual address.
+/// @param  flags   Attributes for the mapped region.
+///
+/// @returns    The virtual address behind the mapped part.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 vmem_map_pt3(pt_t pt3, u64 vaddr, u64 end, u64 offset, u64 flags) {
+
+    pte_t *entry;
+
+    do {
+        entry = &pt3[INDEX_PT3(vaddr)];
+
+        if (vmem_1g_pages && vmem_can_promote(*entry, vaddr, end, offset, flags, PAGE_SIZE_1G)) {
+            *entry = (vaddr + offset) | flags | PAGE_PRESENT;
+            vaddr += PAGE_SIZE_1G;
+        } else {
+            vaddr = vmem_map_pt2(vmem_next_table(entry, vaddr), vaddr, end, offset, flags);
+        }
+
+    } while (vaddr < end && INDEX_PT3(vaddr));
+
+    return vaddr;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Maps the part of a region covered by a 2nd level page table.
+///
+/// @param  pt2     A pointer to the 2nd level page table.
+/// @param  vaddr   The virtual address to start at.
+/// @param  end     The end of the region.
+/// @param  offset  The distance between the physical and the virtual address.
+/// @param  flags   Attributes for the mapped region.
+///
+/// @returns    The virtual address behind the mapped part.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 vmem_map_pt2(pt_t pt2, u64 vaddr, u64 end, u64 offset, u64 flags) {
+
+    pte_t *entry;
+
+    do {
+        entry = &pt2[INDEX_PT2(vaddr)];
+
+        if (vmem_can_promote(*entry, vaddr, end, offset, flags, PAGE_SIZE_2M)) {
+            *entry = (vaddr + offset) | flags | PAGE_PRESENT;
+            vaddr += PAGE_SIZE_2M;
+        } else {
+            vaddr = vmem_map_pt1(vmem_next_table(entry, vaddr), vaddr, end, offset, flags);
+        }
+
+    } while (vaddr < end && INDEX_PT2(vaddr));
+
+    return vaddr;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Maps the part of a region covered by a 1st level page table.
+///
+/// @param  pt1     A pointer to the 1st level page table.
+/// @param  vaddr   The virtual address to start at.
+/// @param  end     The end of the region.
+/// @param  offset  The distance between the physical and the virtual address.
+/// @param  flags   Attributes for the mapped region.
+///
+/// @returns    The virtual address behind the mapped part.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 vmem_map_pt1(pt_t pt1, u64 vaddr, u64 end, u64 offset, u64 flags) {
+
+    // bit 7 selects the memory type in 1st level entries
+    flags = (flags & ~PAGE_HUGE) | PAGE_PRESENT;
+
+    for (u64 index = INDEX_PT1(vaddr); index < PT_ENTRIES && vaddr < end; index++) {
+
+        if (GET_FLAG(pt1[index], PAGE_PRESENT))
+            panic("Virtual address already allocated: %x\n", vaddr);
+
+        pt1[index] = (vaddr + offset) | flags;
+        vaddr += PAGE_SIZE;
+    }
+
+    return vaddr;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 /// @brief  Maps a physical memory region to a virtual address.
 ///
@@ -218,13 +544,152 @@ void vmem_map_region_raw(pt_t pt4, u64 vaddr, u64 paddr, u64 flags, u64 blocks)
 /// @param  pt4     A pointer to the 4th level page table to use.
 /// @param  vaddr   The virtual address of the region to unmap.
 /// @param  blocks  The size of the region in pages.
+///
+/// Walks the page tables like vmem_map_region. Huge pages have to be covered completely, 1st
+/// level page tables the region covers completely are freed. The TLB entries of the region are
+/// invalidated at once when the walk is done (see tlb_gather_flush).
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 void vmem_unmap_region(pt_t pt4,  u64 vaddr, u64 blocks) {
 
-    for (u64 block = 0; block < blocks; block++) {
-        vmem_unmap(pt4, vaddr + block * PAGE_SIZE);
+    u64 end = vaddr + blocks * PAGE_SIZE;
+    tlb_gather_t tlb;
+
+    tlb_gather_init(&tlb, pt4);
+
+    while (vaddr < end) {
+        vaddr = vmem_unmap_pt3(
+                &tlb, vmem_mapped_table(pt4[INDEX_PT4(vaddr)], vaddr), vaddr, end);
+    }
+
+    tlb_gather_flush(&tlb);
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Returns the page table an entry points to.
+///
+/// @param  entry   The entry.
+/// @param  vaddr   The virtual address that is being unmapped.
+///
+/// @returns    A pointer to the next level page table.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+pt_t vmem_mapped_table(pte_t entry, u64 vaddr) {
+
+    if (!GET_FLAG(entry, PAGE_PRESENT))
+        panic("Virtual address has not been allocated yet: %x\n", vaddr);
+
+    return (pt_t)P2V(ADDRESS(entry));
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Unmaps the part of a region covered by a 3rd level page table.
+///
+/// @param  tlb     The batch collecting the unmapped pages.
+/// @param  pt3     A pointer to the 3rd level page table.
+/// @param  vaddr   The virtual address to start at.
+/// @param  end     The end of the region.
+///
+/// @returns    The virtual address behind the unmapped part.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 vmem_unmap_pt3(tlb_gather_t *tlb, pt_t pt3, u64 vaddr, u64 end) {
+
+    pte_t *entry;
+
+    do {
+        entry = &pt3[INDEX_PT3(vaddr)];
+
+        if (GET_FLAG(*entry, PAGE_PRESENT) && GET_FLAG(*entry, PAGE_HUGE)) {
+
+            if (vaddr % PAGE_SIZE_1G || end - vaddr < PAGE_SIZE_1G)
+                panic("Cannot unmap a page of a huge page: %x\n", vaddr);
+
+            *entry = 0;
+            tlb_gather_add(tlb, vaddr);
+            vaddr += PAGE_SIZE_1G;
+
+        } else vaddr = vmem_unmap_pt2(tlb, vmem_mapped_table(*entry, vaddr), vaddr, end);
+
+    } while (vaddr < end && INDEX_PT3(vaddr));
+
+    return vaddr;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Unmaps the part of a region covered by a 2nd level page table.
+///
+/// @param  tlb     The batch collecting the unmapped pages.
+/// @param  pt2     A pointer to the 2nd level page table.
+/// @param  vaddr   The virtual address to start at.
+/// @param  end     The end of the region.
+///
+/// @returns    The virtual address behind the unmapped part.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 vmem_unmap_pt2(tlb_gather_t *tlb, pt_t pt2, u64 vaddr, u64 end) {
+
+    pte_t *entry;
+    pt_t pt1;
+    u64 start;
+
+    do {
+        entry = &pt2[INDEX_PT2(vaddr)];
+
+        if (GET_FLAG(*entry, PAGE_PRESENT) && GET_FLAG(*entry, PAGE_HUGE)) {
+
+            if (vaddr % PAGE_SIZE_2M || end - vaddr < PAGE_SIZE_2M)
+                panic("Cannot unmap a page of a huge page: %x\n", vaddr);
+
+            *entry = 0;
+            tlb_gather_add(tlb, vaddr);
+            vaddr += PAGE_SIZE_2M;
+            continue;
+        }
+
+        pt1 = vmem_mapped_table(*entry, vaddr);
+        start = vaddr;
+        vaddr = vmem_unmap_pt1(tlb, pt1, vaddr, end);
+
+        // the table is empty if the region covered all of it
+        if (vaddr - start == PAGE_SIZE_2M) {
+            *entry = 0;
+            tlb_gather_free_table(tlb, V2P(pt1));
+        }
+
+    } while (vaddr < end && INDEX_PT2(vaddr));
+
+    return vaddr;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Unmaps the part of a region covered by a 1st level page table.
+///
+/// @param  tlb     The batch collecting the unmapped pages.
+/// @param  pt1     A pointer to the 1st level page table.
+/// @param  vaddr   The virtual address to start at.
+/// @param  end     The end of the region.
+///
+/// @returns    The virtual address behind the unmapped part.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 vmem_unmap_pt1(tlb_gather_t *tlb, pt_t pt1, u64 vaddr, u64 end) {
+
+    for (u64 index = INDEX_PT1(vaddr); index < PT_ENTRIES && vaddr < end; index++) {
+
+        if (!GET_FLAG(pt1[index], PAGE_PRESENT))
+            panic("Virtual address has not been allocated yet: %x\n", vaddr);
+
+        pt1[index] = 0;
+        tlb_gather_add(tlb, vaddr);
+        vaddr += PAGE_SIZE;
     }
+
+    return vaddr;
 }
 
 
@@ -233,25 +698,131 @@ void vmem_unmap_region(pt_t pt4,  u64 vaddr, u64 blocks) {
 ///
 /// @returns    A pointer to the new 4th level page table.
 ///
-/// Will copy the kernel map (0xc0000000 - 0xc01xxxxx) into the new page tables.
+/// Will copy the kernel map (0xc0000000 - end of physical memory) and the kernel heap range into
+/// the new page tables.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 
 u64 vmem_create_address_space(void) {
 
-    pt_t pt4 = (pt_t)P2V(pmem_alloc_clean(kernel_pt4, 1));
-    pt_t pt3 = (pt_t)P2V(pmem_alloc_clean(kernel_pt4, 1));
+    pt_t pt4 = (pt_t)P2V(pmem_alloc_clean(1, PMEM_ZONE_ANY));
+    pt_t pt3 = (pt_t)P2V(pmem_alloc_clean(1, PMEM_ZONE_ANY));
 
     pt4[0] = (pte_t)V2P((u64)pt3 | PAGE_PRESENT | PAGE_WRITE | PAGE_USER);
 
-    u64 index = INDEX_PT3(bootinfo->kernel_map.virt);
+    pt_t kernel_pt3 = (pt_t)P2V(ADDRESS(*kernel_pt4));
 
-    /// copy the kernel map 3rd level page table entry from kernel_pt3 to the newly created pt3
-    pt3[index] = ((pt_t)P2V(ADDRESS(*kernel_pt4)))[index];
+    /// copy the kernel map 3rd level page table entries from kernel_pt3 to the newly created pt3
+    for (u64 index = INDEX_PT3(bootinfo->kernel_map.virt); index < kernel_pt3_end; index++)
+        pt3[index] = kernel_pt3[index];
 
     return (u64)pt4;
 }
 
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Clones the user part of an address space copy-on-write.
+///
+/// @param  pt4     A pointer to the 4th level page table to clone.
+///
+/// @returns    A pointer to the 4th level page table of the clone.
+///
+/// The page tables are copied, the pages are shared: writable pages become read-only PAGE_COW
+/// pages in both address spaces and are copied by vmem_cow_fault on the first write.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+u64 vmem_clone_address_space(pt_t pt4) {
+
+    pt_t clone = (pt_t)vmem_create_address_space();
+
+    // the first 512 GiB below the kernel map and everything above them belong to the process
+    vmem_clone_table(
+            (pt_t)P2V(ADDRESS(clone[0])), (pt_t)P2V(ADDRESS(pt4[0])), 3,
+            0, INDEX_PT3(bootinfo->kernel_map.virt));
+    vmem_clone_table(clone, pt4, 4, 1, PT_ENTRIES);
+
+    // the writable pages of the cloned address space are read-only now
+    tlb_flush_all(pt4);
+
+    return (u64)clone;
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Clones a range of page table entries copy-on-write.
+///
+/// @param  dst     A pointer to the page table of the clone.
+/// @param  src     A pointer to the page table to clone.
+/// @param  level   The level of both page tables.
+/// @param  first   The first entry to clone.
+/// @param  last    The entry behind the last entry to clone.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+void vmem_clone_table(pt_t dst, pt_t src, u64 level, u64 first, u64 last) {
+
+    for (u64 index = first; index < last; index++) {
+
+        if (!GET_FLAG(src[index], PAGE_PRESENT)) continue;
+
+        if (level == 1) {
+
+            if (GET_FLAG(src[index], PAGE_WRITE))
+                src[index] = (src[index] & ~PAGE_WRITE) | PAGE_COW;
+
+            dst[index] = src[index];
+            pmem_ref_get(ADDRESS(src[index]));
+            continue;
+        }
+
+        if (GET_FLAG(src[index], PAGE_HUGE)) panic("Cannot clone a huge user page\n");
+
+        dst[index] = pmem_alloc_clean(1, PMEM_ZONE_ANY) |
+            PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+
+        vmem_clone_table(
+                (pt_t)P2V(ADDRESS(dst[index])), (pt_t)P2V(ADDRESS(src[index])), level - 1,
+                0, PT_ENTRIES);
+    }
+}
+
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+/// @brief  Resolves a write to a copy-on-write page.
+///
+/// @param  pt4     A pointer to the 4th level page table of the faulting address space.
+/// @param  vaddr   The faulting virtual address.
+///
+/// @returns    True if the page is writable now, False if it is no copy-on-write page.
+///
+/// The page is copied unless no other address space maps the frame anymore, in which case it
+/// is made writable in place.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+bool vmem_cow_fault(pt_t pt4, u64 vaddr) {
+
+    pte_t *pte = vmem_get_pte(pt4, vaddr);
+    if (!pte || !GET_FLAG(*pte, PAGE_PRESENT) || !GET_FLAG(*pte, PAGE_COW)) return false;
+
+    u64 frame = ADDRESS(*pte);
+    u64 flags = (*pte & ~CLEAR_MASK & ~PAGE_COW) | PAGE_WRITE;
+
+    if (pmem_ref_count(frame)) {
+
+        u64 copy = pmem_alloc(1, PMEM_ZONE_ANY);
+        mem_cpy((u8*)P2V(copy), (u8*)P2V(frame), PAGE_SIZE);
+
+        *pte = copy | flags;
+        tlb_flush_page(pt4, vaddr);
+        pmem_ref_put(frame);
+
+    } else {
+        *pte = frame | flags;
+        tlb_flush_page(pt4, vaddr);
+    }
+
+    return true;
+}
+
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 /// @brief  Initializes the Virtual Memory Manager.
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -261,9 +832,10 @@ void vmem_init(void) {
 
     tty_puts(WHITE_ON_BLACK, "Setting up VMEM...");
 
-    kernel_pt4 = (pt_t)P2V(pmem_alloc_raw(1));
+    kernel_pt4 = (pt_t)P2V(pmem_alloc_raw(1, PMEM_ZONE_ANY));
+    vmem_1g_pages = x86_has_1g_pages();
 
-    // mapping for kernel
+    // mapping for kernel (4 KiB pages, the low memory contains the VGA area and the BIOS)
     vmem_map_region_raw(
             kernel_pt4,
             bootinfo->kernel_map.virt, 
@@ -271,6 +843,42 @@ void vmem_init(void) {
             PAGE_WRITE | PAGE_GLOBAL, 
             kernel_region_end);
 
+    // direct map of the memory pmem hands out (the bitmap and the page tables included),
+    // built once with huge pages so pmem_alloc and pmem_free never touch the page tables
+    u64 base;
+    u64 end;
+    for (u64 i = 0; i < bootinfo->num_regions; i++) {
+
+        if (bootinfo->regions[i].type != FREE && bootinfo->regions[i].type != RECLAIMABLE)
+            continue;
+
+        base = page_round_up(bootinfo->regions[i].base) * PAGE_SIZE;
+        end = page_round_down(bootinfo->regions[i].base + bootinfo->regions[i].length);
+        if (end > bitmap_bit_size) end = bitmap_bit_size;
+        end *= PAGE_SIZE;
+        if (base < kernel_region_end * PAGE_SIZE) base = kernel_region_end * PAGE_SIZE;
+        if (base >= end) continue;
+
+        vmem_map_direct(kernel_pt4, base, end);
+    }
+
+    // preallocate the page directories of the whole physical memory map, 
+    // so pmem_alloc mappings of any zone are visible in every address space
+    pt_t kernel_pt3 = (pt_t)P2V(ADDRESS(kernel_pt4[INDEX_PT4(bootinfo->kernel_map.virt)]));
+    u64 map_end = P2V(pmem_get_usable_mem_range().end - 1);
+    kernel_pt3_end = (map_end >> 39) ? 512 : INDEX_PT3(map_end) + 1;
+
+    // the kernel heap gets the next page directory, so it is shared the same way
+    if (kernel_pt3_end == 512) panic("No virtual memory left for the kernel heap");
+    kernel_heap_base = (map_end & ~(KERNEL_HEAP_SIZE - 1)) + KERNEL_HEAP_SIZE;
+    kernel_pt3_end++;
+
+    for (u64 index = INDEX_PT3(bootinfo->kernel_map.virt); index < kernel_pt3_end; index++) {
+        if (!GET_FLAG(kernel_pt3[index], PAGE_PRESENT)) 
+            kernel_pt3[index] = pmem_alloc_raw(1, PMEM_ZONE_ANY) | 
+                PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+    }
+
     // mapping for VGA (0xa0000 - 0xb8fff)
     u64 vga_size = page_round_up(vga_range.end - vga_range.base);
     vmem_map_region_raw(
@@ -280,16 +888,14 @@ void vmem_init(void) {
             PAGE_WRITE, 
             vga_size);
 
-    // mapping for pmem bitmap and page tables
-    vmem_map_region_raw(
-            kernel_pt4,
-            (u64)bitmap, 
-            V2P(bitmap), 
-            PAGE_WRITE, 
-            page_round_up(bitmap_bit_size / PAGE_SIZE) + blocks_allocated);
-
 
     x86_load_pt4((pt_t)V2P(kernel_pt4));
 
+    // copy-on-write pages have to fault on kernel writes as well
+    x86_write_cr0(x86_read_cr0() | CR0_WP);
+
     tty_puts(WHITE_ON_BLACK, "Done!\n");
+
+    dbg_info("Direct map: %u 1 GiB, %u 2 MiB and %u 4 KiB pages\n",
+            vmem_direct_pages[2], vmem_direct_pages[1], vmem_direct_pages[0]);
 }